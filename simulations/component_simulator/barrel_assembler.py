@@ -63,6 +63,9 @@ A call to mulpgm.disassemble() will generate this, where the studs are in numeri
     zero_e   7  ZERO_E                                                --> outerloop
              8  STOP
 
+A call to mulpgm.download(actions) will generate the commands that load the program into
+the AE prototype's control program, which can then run it with "barrel run". See there.
+
 A call to mulpgm.showverticals() will generate this:
 
 ------  layout of studs on the multiply program barrel ------
@@ -250,6 +253,25 @@ class program: #a program for one barrel
             for vert in range(len(self.verticals)):
                 print(f'{"__*__" if self.verticals[vert][studnum//2] == studnum+STUDON else "_____"}', end="")
             print()
+
+    def download(self, actions, send=print): #generate the commands that load this program into the AE prototype
+        '''actions is a dictionary from stud names to the prototype commands they stand for, like
+        {"ADD_A_TO_B": "run add"}. The jump, conditional, and STOP studs are recognized by name,
+        and any other stud that isn't in actions does nothing. Each command line is given
+        to send(), which could be the "command" method of a stream.py Streamer.'''
+        kinds = {"MOVE1": "move1", "MOVE2": "move2", "MOVE4": "move4", "MOVEBACK": "moveback", "STOP": "stop"}
+        if len(self.studnames)//2 > 32: asmerror("the prototype allows at most 32 studs")
+        send("barrel clear")
+        for studnum in range(0, len(self.studnames), 2):
+            name = self.studnames[studnum]
+            if name in actions: kind = "do " + actions[name]
+            elif name.startswith("IF_NORUNUP"): kind = "ifnorunup"
+            elif name.startswith("IF_RUNUP"): kind = "ifrunup"
+            else: kind = kinds.get(name, "none")
+            send(f"barrel stud {studnum//2} {name} {kind}")
+        for vertnum in range(len(self.verticals)):
+            mask = sum(1 << (stud//2) for stud in self.verticals[vertnum] if stud%2 == STUDON)
+            send(f"barrel vertical {vertnum} {mask:x}")
        
 def jmpgen(n:int, here:int): #generate the stud ON list for a jump of n positions forward or backwards
    studnumlist = []
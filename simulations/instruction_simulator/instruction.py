@@ -62,6 +62,8 @@ Assembler pseudo-operations and control assignments
     label("name")      # define a location at the next instruction to be the target of jumps
     initialize()       # clear the cards and zero all Store variables
     disassemble()      # show the generated operation and variable cards
+    punch("fib.txt")   # write the cards as a deck for the prototype's "cards run" command,
+    punch("fib.txt", commands=True)  # or as "cards punch" commands that stream.py can send
     run()              # execute the cards to run the program
     showvariable("the answer", V7) # display a Store variable
     Trace = True       # enable the trace of operations during the run
@@ -300,6 +302,29 @@ def disassemble(): #disassemble the operation and variable cards into a pseudo-a
     if vcardndx < len(variable_cards): error ("extra variable cards")
     print()
  
+def punch(filename, commands=False): #write the cards in the format that the prototype's "cards" command reads
+    checkcards()
+    cards = [f"D {decimals}"]
+    vcardndx = 0
+    for ocard in operation_cards:
+        jump = ocard.op in {JMP, JMPN, JMPP, JMPZ}
+        sign = 1 if not jump or ocard.forward else -1 #jumps skip cards relative to the next one, and back if negative
+        cards.append(f"O {opnames[ocard.op]}" + (f" {sign*ocard.counter}" if jump else ""))
+        for i in range(opvars[ocard.op]): #the variable cards it uses, in order
+            vcard = variable_cards[vcardndx]
+            vcardndx += 1
+            cards.append("V " + " ".join(axis.name + (".R" if axis.rtype else "") for axis in vcard.axes)
+                         + (f" {sign*vcard.counter}" if jump else ""))
+    for ncard in number_cards:
+        cards.append(f"N {ncard.value}")
+    if commands: #start from a clear deck and store, and set the axes that already have values
+        cards = ["cards clear"] + ["cards punch " + card for card in cards] \
+              + [f"cards store {axis.name} {axis.value}" for axis in variables if axis.value != 0]
+    with open(filename, "w") as f:
+        f.write("\n".join(cards) + "\n")
+    print(f"punched {len(operation_cards)} operation cards, {len(variable_cards)} variable cards, "
+          f"and {len(number_cards)} number cards into {filename}")
+
 variables = [] #create all the axes and the variables naming them
 for i in range(num_store_variables): 
      axis = var_axis(f"V{i}")
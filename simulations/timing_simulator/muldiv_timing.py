@@ -195,6 +195,46 @@ class graphline: #a single line to be added to a Matplotplib graph
     def addline(self, plot): #plot all the points with error bars, and a line through them
         plot.errorbar(self.x, self.y, self.err, fmt='.', markersize=3, linestyle='-', linewidth=.75, elinewidth=.75, capsize=2, label=self.name)
        
+def read_sweep(filename): #read the CSV from the prototype's "sweep" command
+    #returns {script: [measured graphline, predicted graphline]} of seconds per run vs the time unit in msec,
+    #where the prediction is just the number of time units the script did times the time unit
+    lines = {} #script: [measured, predicted, time unit of the point being accumulated]
+    def closepoints(line):
+        if line[2] is not None:
+            line[0].closepoint(line[2])
+            line[1].closepoint(line[2])
+    for text in open(filename):
+        fields = text.strip().split(",")
+        if len(fields) != 7 or not fields[1].isdigit(): continue #the header, warnings, and the summary
+        script = fields[0]
+        timeunit, run, units, wall_msec, over_limits = map(int, fields[1:6])
+        if fields[6] != "1": continue #not reliable, or not checked at the index switches
+        if script not in lines:
+            lines[script] = [graphline(script + " measured", scale=0.001), graphline(script + " predicted", scale=0.001), None]
+        line = lines[script]
+        if line[2] != timeunit: #a new design point
+            closepoints(line)
+            line[0].newpoint()
+            line[1].newpoint()
+            line[2] = timeunit
+        line[0].updatepoint(wall_msec)
+        line[1].updatepoint(units * timeunit)
+    for line in lines.values(): closepoints(line)
+    print()
+    return {script: line[:2] for script, line in lines.items()}
+
+if False: #plot the script times measured on the prototype with "sweep", and what the time units alone predict
+    sweeps = read_sweep("sweep.csv")
+    fig, plot = plt.subplots(dpi=150)
+    for measured, predicted in sweeps.values():
+        measured.addline(plot)
+        predicted.addline(plot)
+    plot.set_xlabel("time unit, msec")
+    plot.set_ylabel("seconds per run")
+    plot.legend()
+    plt.savefig("sweep.jpg", bbox_inches="tight")
+    exit()
+
 if False: #debugging with specific cases
     divide(12345,150, show=True)
     divide(12345,111, show=True)
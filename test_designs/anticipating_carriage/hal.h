@@ -0,0 +1,274 @@
+/***************************************************************************************************
+
+   -----  Hardware abstraction layer for the AE prototype control program  -----
+
+   On the Teensy this is just the Arduino core and EEPROM library, plus a couple of routines
+   that hide the differences between processors in how the STEP pins are pulsed, and
+   in how the optional STEP shift register chain is shifted out over SPI, and a few that
+   read and write text files a line at a time on the built-in SD card. On the Teensy 4.1
+   there is also a DMA player for the optional step timeline; see HAL_STEP_PLAYER.
+
+   For the host (PC) build in the "host" directory HOST_BUILD is defined, and the same
+   interface is instead provided by host/hal_host.cpp with a simulated clock, virtual
+   motors that count their microsteps, index switches that follow the rotators, and
+   an optional directory that stands in for the SD card.
+   That lets the motion and parsing code run many times faster than real time without
+   any hardware, for regression tests and timing sweeps.
+
+   Only what prototype.ino uses is here; add to both sides as needed.
+   ******************************************************************************************************/
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef HOST_BUILD //********  the host build
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+
+typedef uint8_t byte;
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define RISING 3
+#define FALLING 2
+#define CHANGE 4
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+#define digitalWriteFast digitalWrite
+int digitalRead(int pin);
+unsigned long micros(void);    // the simulated clock
+unsigned long millis(void);
+void delay(unsigned long msec);
+void delayMicroseconds(unsigned usec);
+void attachInterrupt(int interrupt, void (*isr)(void), int edge); // only for the index switches
+void detachInterrupt(int interrupt);
+#define digitalPinToInterrupt(pin) (pin)
+#define noInterrupts()         // the timer "interrupt" only happens when the foreground waits,
+#define interrupts()           //   so there is nothing to lock out
+
+struct hal_serial_t {          // the console is stdin and stdout
+   void begin(long baud);
+   int available(void);        // also where simulated time passes while the foreground waits
+   int read(void);
+   int availableForWrite(void);
+   size_t write(uint8_t chr);
+   void print(char chr);
+   void print(const char *str);
+   void println(const char *str);
+   void println(void);
+   int printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))); }; // (so the formats are checked)
+extern struct hal_serial_t Serial;
+
+struct hal_eeprom_t {          // non-volatile memory, optionally kept in a file
+   uint8_t read(int addr);
+   void write(int addr, uint8_t value);
+   void update(int addr, uint8_t value);
+   int length(void); };
+extern struct hal_eeprom_t EEPROM;
+
+struct IntervalTimer {         // the one timer, which fires in simulated time
+   bool begin(void (*isr)(void), unsigned long usec);
+   void end(void);
+   void priority(int priority); };
+
+template<class T> T min(T a, T b) { return a < b ? a : b; }
+template<class T> T max(T a, T b) { return a > b ? a : b; }
+
+void hal_step_port(int pin, volatile uint32_t **set_reg, volatile uint32_t **clear_reg, uint32_t *mask);
+void hal_port_write(volatile uint32_t *reg, uint32_t mask);
+void hal_shift_begin(int latch_pin);
+void hal_shift_steps(int latch_pin, const uint32_t *words, int nwords);
+
+bool hal_sd_begin(void);                           // is there an SD card?
+int hal_sd_open(const char *path);                 // open a file for reading, and return a handle or -1
+bool hal_sd_gets(int file, char *buf, int buflen); // read the next line without the newline; false at the end
+int hal_sd_create(const char *path);               // open a file for writing, replacing it, and return a handle or -1
+void hal_sd_puts(int file, const char *line);      // write a line, and the newline
+void hal_sd_close(int file);
+
+#else //********  the Teensy
+
+#include <EEPROM.h>
+#include <SD.h>
+#ifdef STEP_SHIFT_REGISTERS
+#include <SPI.h>
+#define STEP_SPI_CLOCK 20000000 // the 74HC595 is good to about 25 MHz at 5V, less at 3.3V
+#endif
+
+// Find the GPIO registers that set and clear a pin, and the pin's bit in them.
+static inline void hal_step_port(int pin, volatile uint32_t **set_reg, volatile uint32_t **clear_reg, uint32_t *mask) {
+#if defined(__IMXRT1062__) // Teensy 4.1: the core gives us the 32-bit GPIO registers and the bit mask
+   *set_reg = portSetRegister(pin);
+   *clear_reg = portClearRegister(pin);
+   *mask = digitalPinToBitMask(pin);
+#else // Teensy 3.5/3.6: the core gives us a bit-band alias, so convert it back to the GPIO port and bit
+   uintptr_t offset = (uintptr_t)portOutputRegister(pin) - 0x42000000;
+   volatile uint32_t *pdor = (volatile uint32_t *)(0x40000000 + ((offset >> 5) & ~3));
+   *set_reg = pdor + 1;    // GPIOx_PSOR
+   *clear_reg = pdor + 2;  // GPIOx_PCOR
+   *mask = 1 << ((offset >> 2) & 31);
+#endif
+}
+
+// Set or clear all the pins of a port whose bits are in the mask.
+static inline void hal_port_write(volatile uint32_t *reg, uint32_t mask) {
+   *reg = mask; }
+
+#ifdef STEP_SHIFT_REGISTERS
+static inline void hal_shift_begin(int latch_pin) { // set up for shifting out the STEP chain
+   pinMode(latch_pin, OUTPUT);
+   digitalWriteFast(latch_pin, LOW);
+   SPI.begin(); }
+
+// Shift out the whole STEP chain and latch it, last word first and most significant bit
+// first, so that bit 0 of word 0 ends up in the first output of the nearest register.
+static inline void hal_shift_steps(int latch_pin, const uint32_t *words, int nwords) {
+   SPI.beginTransaction(SPISettings(STEP_SPI_CLOCK, MSBFIRST, SPI_MODE0));
+   for (int ndx = nwords - 1; ndx >= 0; --ndx) {
+      SPI.transfer16(words[ndx] >> 16);
+      SPI.transfer16(words[ndx] & 0xffff); }
+   digitalWriteFast(latch_pin, HIGH); // the rising edge copies the shift registers to the outputs
+   digitalWriteFast(latch_pin, LOW);
+   SPI.endTransaction(); }
+#endif
+
+#if defined(STEP_TIMELINE) && defined(__IMXRT1062__) && !defined(STEP_SHIFT_REGISTERS)
+// Teensy 4.1: a hardware player for the step timeline. The pins it is given are switched
+// from the fast GPIO6..9 ports, which DMA can't reach, to the same bits of GPIO1..4.
+// QuadTimer 1 channel 0 then counts to the time of each entry in a ring of intervals, and
+// at each compare one DMA channel writes the interval after the next one into the timer's
+// compare preload register, and another one linked to it writes the entry's images of the
+// four ports. So the pins change within a fraction of a microsecond of their time, with
+// no interrupt at all. The rings are played round and round until the player is stopped.
+#define HAL_STEP_PLAYER
+#include <DMAChannel.h>
+#define HAL_PLAYER_PORTS 4                            // GPIO1..4, in that order
+#define HAL_PLAYER_TICKS_PER_SEC (F_BUS_ACTUAL / 32)  // the timer counts the IPG clock / 32, about 0.2 usec
+#define HAL_PLAYER_SEGMENT 256                        // intervals per DMA descriptor; a linking channel can do 511
+#define HAL_PLAYER_SIZE (16 * HAL_PLAYER_SEGMENT)     // entries in the rings
+
+static DMAChannel hal_player_timer_dma, hal_player_port_dma;
+static DMASetting hal_player_segments[HAL_PLAYER_SIZE / HAL_PLAYER_SEGMENT];
+static uint32_t (*hal_player_images)[HAL_PLAYER_PORTS];
+
+// Give a pin to the player, and find which of its ports and which bit the pin is.
+static inline void hal_player_pin(int pin, int *port, uint32_t *mask) {
+   *port = ((uintptr_t)portOutputRegister(pin) - (uintptr_t)&GPIO6_DR) / 0x4000; // GPIO6..9 are 16K apart, as are GPIO1..4
+   *mask = digitalPinToBitMask(pin);
+   volatile uint32_t *gpio = &GPIO1_DR + *port * (0x4000 / 4);
+   gpio[0] = (gpio[0] & ~*mask) | (*portOutputRegister(pin) & *mask); // DR: the pin stays as it is,
+   gpio[1] |= *mask;                                                 //   GDIR: as an output,
+   (&IOMUXC_GPR_GPR26)[*port] &= ~*mask; }                           //   but now driven by GPIO1..4
+
+// Set up the DMA for the rings, which are played from their start by hal_player_start().
+static inline void hal_player_begin(uint16_t *intervals, uint32_t (*images)[HAL_PLAYER_PORTS]) {
+   CCM_CCGR6 |= CCM_CCGR6_QTIMER1(CCM_CCGR_ON);
+   hal_player_images = images;
+   hal_player_timer_dma.begin();
+   hal_player_port_dma.begin();
+   DMABaseClass::TCD_t *tcd = hal_player_port_dma.TCD; // each minor loop writes GPIO1_DR..GPIO4_DR, 16K apart
+   tcd->SOFF = 4;
+   tcd->ATTR = DMA_TCD_ATTR_SSIZE(2) | DMA_TCD_ATTR_DSIZE(2);
+   tcd->NBYTES_MLOFFYES = DMA_TCD_NBYTES_DMLOE | DMA_TCD_NBYTES_MLOFFYES_MLOFF(-HAL_PLAYER_PORTS * 0x4000)
+                          | DMA_TCD_NBYTES_MLOFFYES_NBYTES(HAL_PLAYER_PORTS * 4);
+   tcd->SLAST = -HAL_PLAYER_SIZE * HAL_PLAYER_PORTS * 4;
+   tcd->DADDR = &GPIO1_DR;
+   tcd->DOFF = 0x4000;
+   tcd->DLASTSGA = 0;
+   tcd->CSR = 0;
+   const int segments = HAL_PLAYER_SIZE / HAL_PLAYER_SEGMENT;
+   for (int seg = 0; seg < segments; ++seg) { // the intervals go to CMPLD1, each segment chained to the next
+      tcd = hal_player_segments[seg].TCD;
+      tcd->SADDR = intervals + seg * HAL_PLAYER_SEGMENT;
+      tcd->SOFF = 2;
+      tcd->ATTR = DMA_TCD_ATTR_SSIZE(1) | DMA_TCD_ATTR_DSIZE(1);
+      tcd->NBYTES = 2;
+      tcd->SLAST = 0;
+      tcd->DADDR = &TMR1_CMPLD10;
+      tcd->DOFF = 0;
+      tcd->CITER = tcd->BITER = DMA_TCD_CITER_ELINKYES_ELINK | DMA_TCD_CITER_ELINKYES_LINKCH(hal_player_port_dma.channel)
+                                | HAL_PLAYER_SEGMENT; // (and after each one, the port channel does an entry)
+      tcd->DLASTSGA = (int32_t)(uintptr_t)hal_player_segments[(seg + 1) % segments].TCD;
+      tcd->CSR = DMA_TCD_CSR_ESG; }
+   hal_player_timer_dma.triggerAtHardwareEvent(DMAMUX_SOURCE_QTIMER1_WRITE0_CMPLD1); }
+
+// Play the rings from their start: the first entry when the timer gets to "first" ticks,
+// and the second one "second" + 1 ticks after that. The interval in the ring for each entry
+// is the one before the entry two further on, because the timer's compare register is
+// always loaded with the next interval, and its preload register with the one after that.
+static inline void hal_player_start(uint16_t first, uint16_t second) {
+   TMR1_CTRL0 = 0;
+   TMR1_SCTRL0 = 0;
+   TMR1_CNTR0 = 0;
+   TMR1_LOAD0 = 0;
+   TMR1_COMP10 = first;
+   TMR1_CMPLD10 = second;
+   TMR1_CSCTRL0 = TMR_CSCTRL_CL1(1); // COMP1 is loaded from CMPLD1 at each compare
+   hal_player_timer_dma = hal_player_segments[0];
+   hal_player_port_dma.TCD->SADDR = hal_player_images;
+   hal_player_port_dma.TCD->CITER = hal_player_port_dma.TCD->BITER = HAL_PLAYER_SIZE;
+   hal_player_timer_dma.enable();
+   TMR1_DMA0 = TMR_DMA_CMPLD1DE; // which asks for the next interval
+   TMR1_CTRL0 = TMR_CTRL_CM(1) | TMR_CTRL_PCS(8 + 5) | TMR_CTRL_LENGTH; } // count the IPG clock / 32 to COMP1, and again
+
+// Stop playing, and set the ports to these images.
+static inline void hal_player_stop(const uint32_t *images) {
+   TMR1_CTRL0 = 0;
+   TMR1_DMA0 = 0;
+   hal_player_timer_dma.disable();
+   volatile uint32_t *gpio = &GPIO1_DR;
+   for (int port = 0; port < HAL_PLAYER_PORTS; ++port)
+      gpio[port * (0x4000 / 4)] = images[port]; }
+
+// Which entry is to be played next.
+static inline int hal_player_position(void) {
+   return ((uintptr_t)hal_player_port_dma.TCD->SADDR - (uintptr_t)hal_player_images) / (HAL_PLAYER_PORTS * 4); }
+#endif
+
+#define HAL_SD_FILES 4    // how many files can be open at once
+static File hal_sd_files[HAL_SD_FILES];
+
+static inline bool hal_sd_begin(void) {
+   return SD.begin(BUILTIN_SDCARD); }
+
+static inline int hal_sd_open(const char *path) {
+   for (int file = 0; file < HAL_SD_FILES; ++file)
+      if (!hal_sd_files[file]) {
+         hal_sd_files[file] = SD.open(path, FILE_READ);
+         return hal_sd_files[file] ? file : -1; }
+   return -1; }
+
+static inline bool hal_sd_gets(int file, char *buf, int buflen) {
+   File &fp = hal_sd_files[file];
+   if (!fp.available()) return false;
+   int len = 0, chr;
+   while ((chr = fp.read()) >= 0 && chr != '\n')
+      if (chr != '\r' && len < buflen - 1) buf[len++] = chr;
+   buf[len] = 0;
+   return true; }
+
+static inline int hal_sd_create(const char *path) {
+   for (int file = 0; file < HAL_SD_FILES; ++file)
+      if (!hal_sd_files[file]) {
+         SD.remove(path); // (FILE_WRITE appends)
+         hal_sd_files[file] = SD.open(path, FILE_WRITE);
+         return hal_sd_files[file] ? file : -1; }
+   return -1; }
+
+static inline void hal_sd_puts(int file, const char *line) {
+   hal_sd_files[file].println(line); }
+
+static inline void hal_sd_close(int file) {
+   hal_sd_files[file].close(); }
+
+#endif
+#endif
@@ -0,0 +1,382 @@
+/***************************************************************************************************
+
+   -----  Host (PC) implementation of the hardware abstraction layer  -----
+
+   This runs the AE prototype control program on a PC with simulated hardware, as described
+   in hal.h.
+
+   Simulated time only passes when the program waits: for the step timer, in which case
+   the clock jumps to when the timer is due and the step interrupt routine is called, and
+   in delay() and delayMicroseconds(). Everything else takes no time at all, so a script
+   runs thousands of times faster than on the Teensy, with exactly the same step timing.
+
+   The console is stdin and stdout. Input is delivered as if it was typed one line at a
+   time after the previous command was done, so a file of commands can be piped in
+   without the keystrokes aborting the movements. With -s (for streaming) the input
+   is instead available as soon as the program looks for it, even while motors move,
+   which is what a host program using the binary streaming protocol would do.
+
+   The EEPROM starts out erased. With -e it is instead loaded from a file, and the file
+   is rewritten on every EEPROM write, so restarts and power failures can be tried.
+
+   At the end of the input a summary of the simulated time and of the microsteps done on
+   each STEP pin is written to stderr, so that stdout is just what the console would show.
+
+   The index switches for the F and A rotators are modeled as being on (low) for a few
+   microsteps once per revolution of the digit wheels, starting half a revolution away.
+   Their pin interrupts happen right after the STEP pulse that changes them.
+   With -l the motor on a STEP pin loses one of every LOSSY_USTEPS microsteps, as if it
+   was stalling, to try out the lost step detection. With -f the MOTOR_FAULT line goes
+   low for FAULT_USEC at that many simulated msec, and the microsteps done while it is
+   low are counted, to check how fast a fault stops the motors.
+
+   There is no SD card unless -d names a directory, whose files are then read as if
+   they were the card's, so that with -d sd the file sd/scripts/add2.txt is /scripts/add2.txt.
+   Files written to the card, like the scripts from "reschedule", are written there too.
+
+   If STEP_SHIFT_REGISTERS is defined (make DEFINES=-DSTEP_SHIFT_REGISTERS), the STEP
+   outputs are instead the bits of the simulated shift register chain, which are counted
+   the same way when the chain is latched. The -l pin then names the motor whose bit
+   loses steps, which is the one that pin would have been for.
+   ******************************************************************************************************/
+
+#include "hal.h"
+#include <stdarg.h>
+#include <time.h>
+
+extern void setup(void);
+extern void loop(void);
+
+#define NUM_PINS 64
+#define MOTOR_FAULT 2              // these must match prototype.ino
+#define MOTOR_DIR 4
+#define A_ROTATE_INDEX 32
+#define F_ROTATE_INDEX 31
+#define A_ROTATE_STEP_PIN 23       // motor A_R's STEP pin
+#define F_ROTATE_STEP_PIN 19       // motor F_R's STEP pin
+#define A_ROTATE_MOTOR 21          // and their motor numbers, which are their shift register bits
+#define F_ROTATE_MOTOR 10
+static const int motor_step_pins[] = { // the STEP pins of motors 0..23, for the shift register bit of the -l pin
+   9, 10, 11, 12, 8, 7, 6, 5, 17, 18, 19, 20, 16, 15, 14, 13, 25, 26, 27, 28, 24, 23, 22, 21 };
+#define CHAIN_BITS 256             // the longest shift register chain
+#define LOSSY_USTEPS 100           // -l: lose one of this many microsteps
+#define ROTATOR_USTEPS_PER_REV 3323 // with the 54/13 gearset, 800 * 4.15385
+#define INDEX_USTEPS 18           // about 2 degrees of the digit wheels
+#define FAULT_USEC 100000          // -f: how long the fault line stays low
+
+static unsigned long long sim_usec = 0;     // the simulated clock
+static void (*timer_isr)(void) = NULL;       // the step timer routine, if it's running
+static unsigned long long timer_due_usec;    // and when it is due next
+static bool in_isr = false;
+static bool streaming_input = false;         // -s: input is available whenever it is looked for
+static long eeprom_writes = 0;
+static int lossy_pin = -1;                   // -l: the STEP pin whose motor loses steps,
+static int lossy_bit = -1;                   //   and that motor's shift register bit
+static long long fault_usec = -1;            // -f: when the motor fault happens
+static bool fault_signaled = false;          //   whether its interrupt has been done,
+static long fault_usteps = 0;                //   and the microsteps done during it
+
+static int pin_mode[NUM_PINS], pin_value[NUM_PINS];
+static long pin_usteps[NUM_PINS];            // microsteps done on each STEP pin
+static long pin_net_usteps[NUM_PINS];        // and the net clockwise count
+
+static long chain_usteps[CHAIN_BITS];        // microsteps done on each shift register output
+static long chain_net_usteps[CHAIN_BITS];
+
+static uint32_t port_regs[NUM_PINS / 8][2];  // fake "set" and "clear" GPIO registers, 8 pins per port
+static void (*pin_isr[NUM_PINS])(void);      // routines attached to pin interrupts
+static int pin_isr_edge[NUM_PINS];           // and the edges they're for
+
+//****  time
+
+static bool fault_line_low(void) {
+   return fault_usec >= 0 && (long long)sim_usec >= fault_usec && (long long)sim_usec < fault_usec + FAULT_USEC; }
+
+static void check_fault(unsigned long long until_usec) { // do the fault interrupt if it happens by then
+   if (fault_signaled || fault_usec < 0 || (long long)until_usec < fault_usec || in_isr) return;
+   if ((long long)sim_usec < fault_usec) sim_usec = fault_usec;
+   fault_signaled = true;
+   if (pin_isr[MOTOR_FAULT] && pin_isr_edge[MOTOR_FAULT] != RISING) {
+      in_isr = true;
+      pin_isr[MOTOR_FAULT]();
+      in_isr = false; } }
+
+static void run_timer(void) { // advance to when the step timer is due, and do the interrupt routine
+   if (!timer_isr || in_isr) return;
+   check_fault(timer_due_usec);
+   if (!timer_isr) return; // (the fault stopped it)
+   if (timer_due_usec > sim_usec) sim_usec = timer_due_usec;
+   void (*isr)(void) = timer_isr;
+   timer_isr = NULL; // it's one-shot unless the routine restarts it, as ours does
+   in_isr = true;
+   isr();
+   in_isr = false; }
+
+static void pass_time(unsigned long long usec) { // let time pass, doing any timer interrupts that come due
+   unsigned long long end_usec = sim_usec + usec;
+   while (timer_isr && !in_isr && timer_due_usec <= end_usec) run_timer();
+   check_fault(end_usec);
+   if (end_usec > sim_usec) sim_usec = end_usec; }
+
+unsigned long micros(void) {
+   return (unsigned long) sim_usec; }
+
+unsigned long millis(void) {
+   return (unsigned long)(sim_usec / 1000); }
+
+void delay(unsigned long msec) {
+   pass_time(msec * 1000ULL); }
+
+void delayMicroseconds(unsigned usec) {
+   if (!in_isr) pass_time(usec); } // (the interrupt routine's time isn't simulated)
+
+bool IntervalTimer::begin(void (*isr)(void), unsigned long usec) {
+   timer_isr = isr;
+   timer_due_usec = sim_usec + usec;
+   return true; }
+
+void IntervalTimer::end(void) {
+   timer_isr = NULL; }
+
+void IntervalTimer::priority(int /*priority*/) { }
+
+//****  pins and virtual motors
+
+void pinMode(int pin, int mode) {
+   if (pin < 0 || pin >= NUM_PINS) return;
+   pin_mode[pin] = mode;
+   if (mode == INPUT_PULLUP) pin_value[pin] = HIGH; }
+
+void digitalWrite(int pin, int value) {
+   if (pin >= 0 && pin < NUM_PINS) pin_value[pin] = value; }
+
+static int index_switch(long net_usteps) { // low once per revolution
+   long position = net_usteps + ROTATOR_USTEPS_PER_REV / 2;
+   position %= ROTATOR_USTEPS_PER_REV;
+   if (position < 0) position += ROTATOR_USTEPS_PER_REV;
+   return position < INDEX_USTEPS ? LOW : HIGH; }
+
+int digitalRead(int pin) {
+#ifdef STEP_SHIFT_REGISTERS
+   if (pin == A_ROTATE_INDEX) return index_switch(chain_net_usteps[A_ROTATE_MOTOR]);
+   if (pin == F_ROTATE_INDEX) return index_switch(chain_net_usteps[F_ROTATE_MOTOR]);
+#else
+   if (pin == A_ROTATE_INDEX) return index_switch(pin_net_usteps[A_ROTATE_STEP_PIN]);
+   if (pin == F_ROTATE_INDEX) return index_switch(pin_net_usteps[F_ROTATE_STEP_PIN]);
+#endif
+   if (pin == MOTOR_FAULT && fault_line_low()) return LOW;
+   return pin >= 0 && pin < NUM_PINS ? pin_value[pin] : LOW; }
+
+void hal_step_port(int pin, volatile uint32_t **set_reg, volatile uint32_t **clear_reg, uint32_t *mask) {
+   *set_reg = &port_regs[pin / 8][0];
+   *clear_reg = &port_regs[pin / 8][1];
+   *mask = 1u << (pin % 8); }
+
+void attachInterrupt(int pin, void (*isr)(void), int edge) {
+   if (pin == A_ROTATE_INDEX || pin == F_ROTATE_INDEX || pin == MOTOR_FAULT) {
+      pin_isr[pin] = isr;
+      pin_isr_edge[pin] = edge; } }
+
+void detachInterrupt(int pin) {
+   if (pin >= 0 && pin < NUM_PINS) pin_isr[pin] = NULL; }
+
+static void check_index_interrupt(int index_pin, int before) { // call the interrupt routine for a switch change
+   int after = digitalRead(index_pin);
+   int edge = pin_isr_edge[index_pin];
+   if (pin_isr[index_pin] && after != before
+         && (edge == CHANGE || (edge == FALLING && after == LOW) || (edge == RISING && after == HIGH)))
+      pin_isr[index_pin](); }
+
+void hal_port_write(volatile uint32_t *reg, uint32_t mask) { // count the STEP pulses that start
+   int port = (reg - &port_regs[0][0]) / 2;
+   if ((reg - &port_regs[0][0]) % 2 != 0) return; // a clear
+   int a_index = digitalRead(A_ROTATE_INDEX), f_index = digitalRead(F_ROTATE_INDEX);
+   for (int bit = 0; bit < 8; ++bit)
+      if (mask & (1u << bit)) {
+         int pin = port * 8 + bit;
+         if (fault_line_low()) ++fault_usteps;
+         if (++pin_usteps[pin] % LOSSY_USTEPS == 0 && pin == lossy_pin) continue; // the motor didn't move
+         pin_net_usteps[pin] += pin_value[MOTOR_DIR] ? 1 : -1; }
+   check_index_interrupt(A_ROTATE_INDEX, a_index);
+   check_index_interrupt(F_ROTATE_INDEX, f_index); }
+
+static uint32_t chain_latched[CHAIN_BITS / 32]; // what the shift register outputs are now
+
+void hal_shift_begin(int latch_pin) {
+   pinMode(latch_pin, OUTPUT); }
+
+void hal_shift_steps(int /*latch_pin*/, const uint32_t *words, int nwords) { // count the outputs that go high
+   int a_index = digitalRead(A_ROTATE_INDEX), f_index = digitalRead(F_ROTATE_INDEX);
+   for (int word = 0; word < nwords && word < CHAIN_BITS / 32; ++word) {
+      uint32_t rising = words[word] & ~chain_latched[word];
+      for (int bit = 0; bit < 32; ++bit)
+         if (rising & (1u << bit)) {
+            if (fault_line_low()) ++fault_usteps;
+            if (++chain_usteps[word * 32 + bit] % LOSSY_USTEPS == 0 && word * 32 + bit == lossy_bit) continue;
+            chain_net_usteps[word * 32 + bit] += pin_value[MOTOR_DIR] ? 1 : -1; }
+      chain_latched[word] = words[word]; }
+   check_index_interrupt(A_ROTATE_INDEX, a_index);
+   check_index_interrupt(F_ROTATE_INDEX, f_index); }
+
+//****  the console
+
+struct hal_serial_t Serial;
+static int pending_chr = '\n';    // the next input character, or -1; we start as if Enter was hit
+static bool at_line_start = true; // has the program yet to see anything of the next line?
+static bool polled_idle = false;  // and has it looked once without seeing it?
+
+static void finish(void) { // the end of the input: summarize and quit
+   fflush(stdout);
+   fprintf(stderr, "host: %llu.%06llu simulated seconds in %lu msec of CPU time, %ld EEPROM writes\n", sim_usec / 1000000,
+           sim_usec % 1000000, (unsigned long)(clock() * 1000 / CLOCKS_PER_SEC), eeprom_writes);
+   for (int pin = 0; pin < NUM_PINS; ++pin)
+      if (pin_usteps[pin])
+         fprintf(stderr, "  STEP pin %2d: %8ld microsteps, net %+ld\n", pin, pin_usteps[pin], pin_net_usteps[pin]);
+   for (int bit = 0; bit < CHAIN_BITS; ++bit)
+      if (chain_usteps[bit])
+         fprintf(stderr, "  STEP bit %3d: %8ld microsteps, net %+ld\n", bit, chain_usteps[bit], chain_net_usteps[bit]);
+   if (fault_usec >= 0)
+      fprintf(stderr, "  motor fault at %lld msec: %ld microsteps while the fault line was low\n", fault_usec / 1000, fault_usteps);
+   exit(0); }
+
+void hal_serial_t::begin(long /*baud*/) { }
+
+int hal_serial_t::available(void) {
+   if (pending_chr >= 0) return 1;
+   if (timer_isr && !streaming_input) { // motors are moving, and nobody types while they are
+      run_timer();
+      return 0; }
+   if (at_line_start && !polled_idle) { // the next line is typed only after the program is seen to be waiting
+      polled_idle = true;
+      return 0; }
+   pending_chr = getchar();
+   if (pending_chr == EOF) {
+      pending_chr = -1;
+      if (timer_isr) { // let the movements finish first
+         run_timer();
+         return 0; }
+      finish(); }
+   polled_idle = false;
+   at_line_start = pending_chr == '\n';
+   return 1; }
+
+int hal_serial_t::read(void) {
+   if (!available()) return -1;
+   int chr = pending_chr;
+   pending_chr = -1;
+   return chr; }
+
+int hal_serial_t::availableForWrite(void) {
+   return 1000; }
+
+size_t hal_serial_t::write(uint8_t chr) {
+   putchar(chr);
+   return 1; }
+
+void hal_serial_t::print(char chr) {
+   putchar(chr); }
+
+void hal_serial_t::print(const char *str) {
+   fputs(str, stdout); }
+
+void hal_serial_t::println(const char *str) {
+   puts(str); }
+
+void hal_serial_t::println(void) {
+   putchar('\n'); }
+
+int hal_serial_t::printf(const char *fmt, ...) {
+   va_list args;
+   va_start(args, fmt);
+   int count = vprintf(fmt, args);
+   va_end(args);
+   return count; }
+
+//****  EEPROM
+
+struct hal_eeprom_t EEPROM;
+static uint8_t eeprom[4096];
+static const char *eeprom_filename = NULL; // -e: where the EEPROM is kept between runs
+
+uint8_t hal_eeprom_t::read(int addr) {
+   return addr >= 0 && addr < (int)sizeof(eeprom) ? eeprom[addr] : 0xff; }
+
+void hal_eeprom_t::write(int addr, uint8_t value) {
+   if (addr < 0 || addr >= (int)sizeof(eeprom)) return;
+   eeprom[addr] = value;
+   ++eeprom_writes;
+   if (eeprom_filename) { // save it now, in case the "power fails"
+      FILE *file = fopen(eeprom_filename, "wb");
+      if (file) {
+         fwrite(eeprom, 1, sizeof(eeprom), file);
+         fclose(file); } } }
+
+void hal_eeprom_t::update(int addr, uint8_t value) {
+   if (read(addr) != value) write(addr, value); }
+
+int hal_eeprom_t::length(void) {
+   return sizeof(eeprom); }
+
+static void load_eeprom(void) {
+   memset(eeprom, 0xff, sizeof(eeprom)); // erased
+   FILE *file = eeprom_filename ? fopen(eeprom_filename, "rb") : NULL;
+   if (file) {
+      if (fread(eeprom, 1, sizeof(eeprom), file) != sizeof(eeprom)) memset(eeprom, 0xff, sizeof(eeprom));
+      fclose(file); } }
+
+//****  the SD card
+
+#define SD_FILES 4
+static const char *sd_directory = NULL; // -d: what stands in for the SD card
+static FILE *sd_files[SD_FILES];
+
+bool hal_sd_begin(void) {
+   return sd_directory != NULL; }
+
+static int sd_fopen(const char *path, const char *mode) {
+   char filename[512];
+   snprintf(filename, sizeof(filename), "%s/%s", sd_directory, path);
+   for (int file = 0; file < SD_FILES; ++file)
+      if (!sd_files[file]) return (sd_files[file] = fopen(filename, mode)) ? file : -1;
+   return -1; }
+
+int hal_sd_open(const char *path) {
+   return sd_fopen(path, "r"); }
+
+int hal_sd_create(const char *path) {
+   return sd_fopen(path, "w"); }
+
+void hal_sd_puts(int file, const char *line) {
+   fprintf(sd_files[file], "%s\n", line); }
+
+bool hal_sd_gets(int file, char *buf, int buflen) {
+   if (!fgets(buf, buflen, sd_files[file])) return false;
+   size_t len = strlen(buf);
+   if (len && buf[len - 1] == '\n') buf[--len] = 0;
+   else { // (the Teensy version drops the rest of a long line)
+      int chr;
+      while ((chr = fgetc(sd_files[file])) != EOF && chr != '\n') ; }
+   if (len && buf[len - 1] == '\r') buf[--len] = 0;
+   return true; }
+
+void hal_sd_close(int file) {
+   fclose(sd_files[file]);
+   sd_files[file] = NULL; }
+
+//****  the main program
+
+int main(int argc, char **argv) {
+   for (int arg = 1; arg < argc; ++arg) {
+      if (strcmp(argv[arg], "-s") == 0) streaming_input = true;
+      else if (strcmp(argv[arg], "-e") == 0 && arg + 1 < argc) eeprom_filename = argv[++arg];
+      else if (strcmp(argv[arg], "-l") == 0 && arg + 1 < argc) lossy_pin = atoi(argv[++arg]);
+      else if (strcmp(argv[arg], "-d") == 0 && arg + 1 < argc) sd_directory = argv[++arg];
+      else if (strcmp(argv[arg], "-f") == 0 && arg + 1 < argc) fault_usec = atoll(argv[++arg]) * 1000;
+      else {
+         fprintf(stderr, "use: prototype_host [-s] [-e eeprom_file] [-l lossy_step_pin] [-d sd_directory] [-f fault_msec] < commands\n");
+         return 1; } }
+   for (int motor = 0; motor < (int)(sizeof(motor_step_pins) / sizeof(motor_step_pins[0])); ++motor)
+      if (motor_step_pins[motor] == lossy_pin) lossy_bit = motor;
+   load_eeprom();
+   setup();
+   while (1) loop(); }
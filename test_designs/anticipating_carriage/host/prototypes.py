@@ -0,0 +1,49 @@
+'''file: prototypes.py
+
+    *******  ARDUINO-STYLE PROTOTYPE GENERATOR FOR THE HOST BUILD  *********
+
+The Arduino IDE lets functions in a sketch be used before they are defined by adding
+a prototype for each one just before the first function. This does the same, so that
+the sketch can be compiled as ordinary C++:
+
+    python prototypes.py ../prototype.ino > prototype.cpp
+
+As in the IDE, the prototypes can only use types that are declared before the first
+function. Default arguments are removed from the prototypes.
+'''
+import re, sys
+
+def blank_comments(text): # replace comments and string contents with spaces, keeping the line structure
+    blank = lambda m: re.sub(r"[^\n]", " ", m.group(0))
+    text = re.sub(r'"(\\.|[^"\\\n])*"|\'(\\.|[^\'\\])\'',
+                  lambda m: m.group(0)[0] + " " * (len(m.group(0)) - 2) + m.group(0)[0], text)
+    text = re.sub(r"//[^\n]*", blank, text)
+    return re.sub(r"/\*.*?\*/", blank, text, flags=re.S)
+
+function = re.compile(r"([A-Za-z_][\w \t\*\n]*?[\s\*])(\w+)\s*\(([^;{}()]*(?:\([^()]*\)[^;{}()]*)*)\)\s*\{")
+
+def prototypes(source):
+    clean = blank_comments(source)
+    protos, first_line, pos = [], None, 0
+    while True:
+        m = function.search(clean, pos)
+        if not m: break
+        pos = m.end()
+        before = clean[:m.start()]
+        if before.count("{") != before.count("}"): continue # not at the outer level
+        return_type = m.group(1).split("\n")[-1].strip()
+        name = m.group(2)
+        if (name in ("if", "while", "for", "switch", "main") or "=" in return_type
+                or return_type.split()[-1] == "struct"): continue
+        params = re.sub(r"=[^,]*", "", " ".join(m.group(3).split()))
+        protos.append("%s %s(%s);" % (return_type, name, params))
+        if first_line is None: first_line = source[:m.start(2)].count("\n")
+    return protos, first_line
+
+if __name__ == "__main__":
+    filename = sys.argv[1]
+    source = open(filename).read()
+    protos, first_line = prototypes(source)
+    lines = source.split("\n")
+    print('#line 1 "%s"' % filename)
+    print("\n".join(lines[:first_line] + protos + ['#line %d "%s"' % (first_line + 1, filename)] + lines[first_line:]))
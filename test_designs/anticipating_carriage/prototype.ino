@@ -52,17 +52,61 @@
        keepers {up | down |              // lift or rotate the carry sector keepers
              none | top | both}
 
+   Any primitive or functional movement can be followed by timing options:
+       in <percent>%           // take this percentage of the time unit instead of all of it
+       after [rot | lift] <axlename>  // start when that axle's movement in this time unit ends
+   A time unit ends when its last movement does, so short movements and the ones that
+   depend on them can be done together. For example: carry add in 25%; rot c 30 after w
+
    multi-step movement commands
-       run <script>            // run a predefined cycle of operations
+       run <script>            // run a predefined cycle of operations, or one from the SD card
        step <script>           // same, but wait for input between steps
+       together <script> <script> ...  // run compiled scripts at once, if they use different motors
+       library {show | flush}  // show or forget the scripts from the SD card that are cached
+       reschedule {<script> | barrel} [<name>]  // find an equivalent schedule with fewer time units,
+                               //   and write it to the SD card as the script <name>
+
+   barrel program commands, usually sent by the barrel assembler: see the section below
+       barrel clear                                  // forget the barrel program
+       barrel stud <n> <name> {none | move1 | move2 | move4 | moveback | ifrunup | ifnorunup | stop}
+       barrel stud <n> <name> do <commands>          // define stud n; "do" takes the rest of the line
+       barrel vertical <n> <hex mask of the "on" studs>
+       barrel runup {on | off}                       // set the "running up" condition
+       barrel show                                   // show the program
+       barrel run [<vertical>]                       // run from vertical 0, or that one, until a STOP
+
+   operation and variable card commands, for decks from instruction.py: see the section below
+       cards run [<deck>]      // run the deck /cards/<deck>.txt on the SD card, or the punched one
+       cards punch <card>      // add a card to the punched deck, usually sent by stream.py
+       cards clear             // forget the punched deck, and zero the store
+       cards store [V<n> <value>]  // show the store, or set an axis
+
+   digit wheel model commands: see the section below
+       value [F | A1 | A2] [<number> | unknown]   // show what we think is on the digit wheels, or set it
+       skipif {zero | nonzero | carry | nocarry} {F | A1 | A2} [<lines>]
+                               // in a script, skip the next lines, or all the rest, if
+                               //   the digit wheels are known to meet the condition
+       skipunless ...          // same, but skip unless they are known to meet it
+
+   The predefined scripts are compiled into tables of elementary movements on startup,
+   and any interlock errors in them are reported then.
+       optimize {on | off}     // merge repeated movements in compiled scripts into continuous ones
 
    control commands
        off                     // turn off all motors so things can be moved by hand
        on                      // energize and lock all motors
        home                    // move everything to the initial positions
        reset                   // reset the internal state to initial positions without moving
+       autostart {on | off}    // on power-up, whether to start without waiting for Enter on the console
        timeunit <msecs>        // set the time duration that basic operations take
-       debug n                 // request debug output, from 0 (none) to 3 (lots)
+       stats [reset]           // show (or reset) the step engine statistics
+       lostcheck {off | correct | stop}  // what to do when the index switches show lost steps
+       bench {<script> | motors | all} <repetitions>
+                               // benchmark the step engine with the motors disabled
+       sweep <script> <min_msecs> <max_msecs> <step_msecs>
+                               // find the shortest reliable time unit for a script, as CSV
+       debug n                 // request debug output, from 0 (none) to 3 (lots);
+                               //   2 or more also traces the movements: see trace_decode.py
 
    Except for the rotational position of the finger axles that can be initialized with
    the "zero" command, the machine cannot sense the current state. It assumes the
@@ -73,13 +117,34 @@
       nofinger F; nofinger A;
       setcarry 9; keepers top
 
+   We do keep a model of what number is on each stack of digit wheels once it has been
+   zeroed, though, so that scripts can skip work that isn't needed, like zeroing a wheel
+   that is already zero, and so that "value" can show the numbers without a readout cycle.
+
+   Once F or A has been zeroed, too, its index switch is watched whenever it rotates,
+   and a switch that closes earlier or later than the microsteps done say it should is
+   reported as lost steps. Then the steps are made up when the movements are finished,
+   or with "lostcheck stop" the movements are aborted so a slower time unit can be used.
+
    Information about the rotational position sensor that is gathered by the "calibrate"
    command is recorded in non-voltaile EEPROM memory and loaded on startup.
+   The positions of all the axles are also journaled in EEPROM whenever the movements
+   are finished, so after a restart they are restored instead of being assumed.
 
    Commands are entered from a serial console, which should be set for "newline" as the
    ending character. We use the Coolterm terminal emulator because the Arduino Serial Monitor
    doesn't allow reading individual characters until Enter has been hit.
 
+   A host program can instead stream commands as binary frames with flow control, so
+   that long generated programs run without any gaps; see stream.py.
+
+   The hardware is reached through hal.h, so this can also be built to run on a PC with
+   simulated motors and clock, many times faster than real time; see host/hal_host.cpp.
+   For more than 24 motors, define STEP_SHIFT_REGISTERS to drive the STEP inputs from a
+   chain of shift registers; nothing else, including the commands, changes. Define
+   STEP_TIMELINE to compute the step times ahead of time, so the interrupts only pulse pins,
+   or on a Teensy 4.1, so DMA plays them out to the pins with no step interrupts at all.
+
    Several commands can be on one line, separated by semicolons.
    Hitting "Enter" on an empty line repeats the last command.
    Hitting "backspace" on an empty line repeats the next-to-last command.
@@ -101,7 +166,13 @@
 #define uSTEPS_PER_STEP 4            // how many microsteps per step the drivers are configured for (MODE1 high)
 #define STEPS_PER_ROTATION 200       // 1.8 degree step angle for Nema 11 2-phase stepper motor
 #define LIFT_MILS_PER_ROTATION 315   // lead screw lift is 8mm/rotation, or 314.96 mils 
+//#define STEP_SHIFT_REGISTERS        // drive the STEP inputs from shift registers instead of pins; see below
+//#define STEP_TIMELINE               // compute the step times ahead in the foreground; see the step timeline
+#ifdef STEP_SHIFT_REGISTERS
+#define NUM_MOTORS 128               // maximum possible motors: 16 8-bit shift registers
+#else
 #define NUM_MOTORS 24                // maximum possible motors; 16 are currently implemented)
+#endif
 #define DIGIT_REPETITIONS 3          // number of repetitions of 0-9 on each wheel
 #define DEFAULT_TIMEUNIT_MSEC 500    // default time unit for moving one digit
 #define DEBOUNCE  25                 // switch debounce time in msec
@@ -111,7 +182,8 @@
 
 // Teensy hardware
 
-#include <EEPROM.h>
+#include "hal.h"
+#include <limits.h>
 #define MOTOR_FAULT 2       // active low input: motor fault detected
 #define MOTOR_ENB 3         // active low output: enable all motors
 #define MOTOR_DIR 4         // direction control for all motors
@@ -123,6 +195,19 @@ const byte motor_step_pins [] = { // map motor numbers 0..23 to STEP Teensy 3.5
    9, 10, 11, 12, 8, 7, 6, 5,          // group 1 (left) 0...7
    17, 18, 19, 20, 16, 15, 14, 13,     // group 2 (middle) 8..15
    25, 26, 27, 28, 24, 23, 22, 21 };   // group 3 (right) 16..23
+#ifdef STEP_SHIFT_REGISTERS
+// For more motors than there are pins, the STEP inputs are instead driven by a chain of
+// 74HC595 shift registers on the SPI port, with their output enables tied low. Motor n
+// is output n of the chain, counting from the register nearest the Teensy. The whole
+// chain is shifted and latched once per step interrupt, so all the STEP pulses that are
+// due together still start at the same instant, and the time that takes depends only on
+// the length of the chain, not on how many motors are moving. The direct STEP pins above
+// are not used, because SPI needs some of them.
+#define STEP_LATCH_PIN 10  // RCLK of all the shift registers; MOSI (11) goes to SER, SCK (13) to SRCLK
+#define MAX_STEP_PORTS ((NUM_MOTORS + 31) / 32) // the chain is shifted out as this many 32-bit words
+#else
+#define MAX_STEP_PORTS 6   // the STEP pins are spread over at most this many GPIO ports
+#endif
 
 // symbolic names for motor numbers from 0..23 as positioned on the boards
 // so that the cables from the motors reach the boards with minimum tangles;
@@ -147,36 +232,64 @@ const byte motor_step_pins [] = { // map motor numbers 0..23 to STEP Teensy 3.5
 
 enum movement_t {ROTATE, LIFT };  // movement types
 
+// acceleration and velocity limits for the trapezoidal speed ramps, in microsteps/sec/sec and microsteps/sec
+#define LIFT_ACCEL    200000  // lead screw lifters
+#define LIFT_VMAX      12000
+#define GEARED_ACCEL   40000  // the geared finger rotators, which turn a whole stack of digit wheels
+#define GEARED_VMAX     8000
+#define ROTATE_ACCEL  100000  // locks, carry sectors, keepers, and the wire carrier
+#define ROTATE_VMAX     8000
+
+struct step_profile_t { // how the microsteps of one movement are spaced within its time unit
+   unsigned long ustep_interval_usec;   // the whole part of the time between steps
+   unsigned ustep_interval_rem;         // the fractional part, in units of 1/usteps usec
+   bool ramped;                         // does it follow a speed ramp instead?
+   float ramp_usteps;                   // if so: how many steps are in each ramp,
+   float ramp_usec;                     //   how long each ramp takes,
+   float ramp_factor;                   //   2/acceleration, in usec*usec per microstep,
+   float cruise_usec_per_ustep;         //   and the step interval at full speed
+   unsigned long start_usec;            // when the movement starts, relative to the start of the time unit
+   unsigned long duration_usec; };      // the duration of the whole movement
+
 struct motord_t { //**** a motor descriptor
    int motor_number;                    // 0..23, as defined symbolically above
    enum movement_t motor_type;          // does it rotate or lift?
    const char *axle_name;               // name used in the "rot" or "lift" commands
    unsigned gear_ratio;                 // if not zero, gear reduction ratio x 1000
+   unsigned long accel;                 // if not zero, maximum acceleration in microsteps/sec/sec
+   unsigned long max_velocity;          // if not zero, maximum velocity in microsteps/sec
    int finger_zero_degrees;             // for A and F: zero is this number of degrees past the switch point
-   bool moving;                         // is this motor scheduled for movement?   
+   volatile bool moving;                // is this motor scheduled for movement?   
    bool clockwise;                      // in which direction?
-   unsigned usteps_needed, usteps_done; // how many movement pulses are needed, and done
-   unsigned long last_ustep_time_usec;  // when the last step was done
+   unsigned usteps_needed, usteps_done; // how many movement pulses are needed, and done (when it stopped)
    int current_position;                // current position relative to neutral, in units that depend on the axle
+   long ustep_fraction;                 // the signed part of a microstep that movements so far haven't done,
+                                        //   in units of 1/360000 for rotators and 1/LIFT_MILS_PER_ROTATION for lifters
+   volatile long net_usteps;            // net clockwise microsteps done, for the rotators with index switches:
+   bool index_referenced;               //   are they relative to where the switch closes?
+   long index_usteps;                   //   where we last checked that it did
+   volatile int lost_usteps;            //   microsteps it was found to be behind, not yet reported
+   int correction_usteps;               //   and not yet made up
+   byte step_port;                      // which of the step_ports[] the STEP pin is on
+   uint32_t step_mask;                  // the bit for the STEP pin in that port
 }
 motor_descriptors[] = {  // an unordered list of descriptors for motors
-   //  put longer names first so they get scanned first in case later ones are prefixes
-   {A1K_R, ROTATE, "a1k" },
-   {A2K_R, ROTATE, "a2k" },
-   {MPC_L, LIFT, "mpc" },
-   {FPC_L, LIFT, "fpc" },
-   {FK_R, ROTATE, "fk" },
-   {FC_L, LIFT, "fc" },
-   {MP_L, LIFT, "mp" },
-   {A_L, LIFT, "al" },
-   {A_R, ROTATE, "ar", 4154, -10 }, // has 54/13 = 4.15385 gearset
-   {F_L, LIFT, "fl" },
-   {F_R, ROTATE, "fr", 4154, -10 }, // has 54/13 = 4.15385 gearset
-   {C_R, ROTATE, "c" },
-   {W_R, ROTATE, "w" },
-   {N_L, LIFT, "n" },
-   {H_R, ROTATE, "h" },
-   {H_L, LIFT, "h" },
+   {A1K_R, ROTATE, "a1k", 0, ROTATE_ACCEL, ROTATE_VMAX },
+   {A2K_R, ROTATE, "a2k", 0, ROTATE_ACCEL, ROTATE_VMAX },
+   {MPC_L, LIFT, "mpc", 0, LIFT_ACCEL, LIFT_VMAX },
+   {FPC_L, LIFT, "fpc", 0, LIFT_ACCEL, LIFT_VMAX },
+   {FK_R, ROTATE, "fk", 0, ROTATE_ACCEL, ROTATE_VMAX },
+   {FC_L, LIFT, "fc", 0, LIFT_ACCEL, LIFT_VMAX },
+   {MP_L, LIFT, "mp", 0, LIFT_ACCEL, LIFT_VMAX },
+   {A_L, LIFT, "al", 0, LIFT_ACCEL, LIFT_VMAX },
+   {A_R, ROTATE, "ar", 4154, GEARED_ACCEL, GEARED_VMAX, -10 }, // has 54/13 = 4.15385 gearset
+   {F_L, LIFT, "fl", 0, LIFT_ACCEL, LIFT_VMAX },
+   {F_R, ROTATE, "fr", 4154, GEARED_ACCEL, GEARED_VMAX, -10 }, // has 54/13 = 4.15385 gearset
+   {C_R, ROTATE, "c", 0, ROTATE_ACCEL, ROTATE_VMAX },
+   {W_R, ROTATE, "w", 0, ROTATE_ACCEL, ROTATE_VMAX },
+   {N_L, LIFT, "n", 0, LIFT_ACCEL, LIFT_VMAX },
+   {H_R, ROTATE, "h", 0, ROTATE_ACCEL, ROTATE_VMAX },
+   {H_L, LIFT, "h", 0, LIFT_ACCEL, LIFT_VMAX },
    { -1 } };
 
 struct motord_t *motor_num_to_descr [NUM_MOTORS] // map from motor number to motor descriptor
@@ -184,6 +297,9 @@ struct motord_t *motor_num_to_descr [NUM_MOTORS] // map from motor number to mot
 
 //***** functional motor movements
 
+#define CARRY_ADD_POSITION 12   // the wire carrier position that rotates the carry sectors to add 1
+#define CARRY_SUB_POSITION -12  //   or to subtract 1
+
 struct fct_move_t { // basic movement specification
    const char *keyword1;  // primary keyword identifying axle to move
    const char *keyword2;  // optional secondary keyword
@@ -225,8 +341,8 @@ fct_setcarry[] = {
 fct_carry[] = {
    {"up", NULL, N_L, 400 },
    {"down", NULL, N_L, 0 },
-   {"add", NULL, W_R, 12 },
-   {"sub", NULL, W_R, -12 }, { } },
+   {"add", NULL, W_R, CARRY_ADD_POSITION },
+   {"sub", NULL, W_R, CARRY_SUB_POSITION }, { } },
 fct_keepers[] = {
    {"none", NULL, H_R, 0 },
    {"top", NULL, H_R, 45 },
@@ -236,9 +352,25 @@ fct_keepers[] = {
 
 // predefined scripts
 
+struct script_op_t { // one elementary movement in a compiled script
+   int motor_num;            // the motor to move, or END_OF_UNIT or SKIP_OP
+   int position;             // for functional moves, the position to move to; otherwise NO_POSITION
+   int distance;             // the distance the move was compiled for
+   unsigned usteps;          // how many microsteps that takes, less any carried fraction
+                             //   (for SKIP_OP: the skip_condition_t, the stack, and how many lines)
+   int percent;              // if not zero, the percentage of the time unit it takes
+   int after;                // if not -1, the motor whose movement it starts after
+   int lines; };             // for END_OF_UNIT, how many script lines the time unit does
+#define END_OF_UNIT -1
+#define SKIP_OP -2           // a "skipif" that is tested when the script is run
+#define SKIP_REST 1000       // how many lines it skips to skip the rest of the script
+#define NO_POSITION INT_MIN
+#define MAX_SCRIPT_OPS 400   // total micro-ops for all compiled scripts
+
 struct script_t {
    const char *name;         // the name of the script
-   const char **commands; }  // pointer to an array of commands
+   const char **commands;    // pointer to an array of commands
+   struct script_op_t *ops; } // the compiled micro-ops, or NULL if it couldn't be compiled
 
 home_commands = {"home", (const char *[]) { // reset everything to initial positions
    // all of it is done in one time unit
@@ -249,6 +381,7 @@ home_commands = {"home", (const char *[]) { // reset everything to initial posit
 named_scripts[] = { // scripts that are searched by name for "run" and "step"
    {
       "zero", (const char *[]) { // zero the number on A1
+         "skipif zero A1", // (unless there's nothing to do)
          "finger A1; unlock A1",
          "giveoff A",
          "giveoff A",
@@ -264,6 +397,7 @@ named_scripts[] = { // scripts that are searched by name for "run" and "step"
          NULL  } },
    {
       "copy", (const char *[]) { // transfer the number on A1 to F
+         "skipif zero A1", // (unless there's nothing to do)
          "finger A1; mesh FC; mesh MPC A1; unlock F; unlock A1",
          "giveoff A",
          "giveoff A",
@@ -279,6 +413,7 @@ named_scripts[] = { // scripts that are searched by name for "run" and "step"
          NULL  } },
    {
       "add", (const char *[]) { // add the number on A1 to F
+         "skipif zero A1", // (unless there's nothing to do)
          "finger A1; mesh FC; mesh MPC A1; keepers none; unlock F; unlock A1",
          "giveoff A",
          "giveoff A",
@@ -289,6 +424,10 @@ named_scripts[] = { // scripts that are searched by name for "run" and "step"
          "giveoff A",
          "giveoff A",
          "giveoff A",
+         "skipunless nocarry F 3", // when no digit warned, the carriage can be skipped:
+         "nofinger A; unmesh FC; unmesh MPC; lock F; lock A1",
+         "giveoff A; keepers top",
+         "skipif nocarry F", // (which is still true)
          "nofinger A; unmesh FC; unmesh MPC; carry up; keepers up; lock F; lock A1",
          "giveoff A; keepers both",
          "carry down; unlock F",
@@ -304,7 +443,9 @@ struct { // the configuration record written to non-volatile EEPROM memory
 #define CONFIG_ID "Babbage"
    char id[8];
    int a_finger_zero_degrees;
-   int f_finger_zero_degrees; } config = {0 };
+   int f_finger_zero_degrees;
+   byte autostart; } config = {0 };  // AUTOSTART_ON to start without waiting for the console
+#define AUTOSTART_ON 0xA5    // (so that an older config block without this doesn't autostart)
 
 //****  initialization
 
@@ -315,8 +456,27 @@ unsigned long timeunit_usec = DEFAULT_TIMEUNIT_MSEC * 1000L; // to move one digi
 #define timeunit_degree_usec (timeunit_usec * 10 * DIGIT_REPETITIONS / 360)
 
 int debug = 1;               // debug level from 0 to 3
-int motors_moving = 0;       // how many motors are currently queued up to move
+volatile int motors_moving = 0;  // how many motors are moving in the time unit the step engine is doing
+volatile unsigned long total_usteps = 0; // how many microsteps the step engine has done
+unsigned long unit_usteps;       // how many it has done in this time unit
+unsigned long unit_start_usec;   // when the current time unit started
+unsigned long unit_duration_usec; // how long it lasts
 bool got_error = false;      // was an error generated during this action?
+bool compiling = false;      // are we compiling a script rather than doing it?
+bool dry_run = false;        // are we keeping the motors disabled while moving, for "bench"?
+bool streaming = false;      // are we receiving binary frames rather than text from the console?
+bool aborted = false;        // were the movements aborted since this was last cleared?
+volatile bool fault_latched = false; // did the motor fault interrupt happen, even if the line is high again?
+bool key_waiting = false;    // has console_poll() seen a key typed while the motors were moving?
+
+IntervalTimer step_timer;    // interrupts when the next microstep for some motor is due
+#define STEP_TIMER_PRIORITY 16  // higher priority (lower number) than USB serial, so steps aren't delayed
+#define MIN_TIMER_USEC 2        // the shortest interval we can ask the timer for
+
+bool autostart_configured(void) { // should we start without waiting for someone to hit Enter?
+   for (unsigned i = 0; i < sizeof(config); ++i)
+      ((char *)&config)[i] = EEPROM.read(i);
+   return strncmp(config.id, CONFIG_ID, sizeof(config.id)) == 0 && config.autostart == AUTOSTART_ON; }
 
 void read_config(void) {
    for (unsigned i = 0; i < sizeof(config); ++i)
@@ -331,29 +491,39 @@ void read_config(void) {
 
 void write_config(void) {
    strcpy(config.id, CONFIG_ID);
+   config.a_finger_zero_degrees = motor_num_to_descr[A_R]->finger_zero_degrees;
+   config.f_finger_zero_degrees = motor_num_to_descr[F_R]->finger_zero_degrees;
    for (unsigned i = 0; i < sizeof(config); ++i)
       EEPROM.write(i, ((char *)&config)[i]);
    Serial.printf("config block written\n"); }
 
 void setup(void) {
    pinMode(MOTOR_FAULT, INPUT_PULLUP);
+   attachInterrupt(digitalPinToInterrupt(MOTOR_FAULT), fault_isr, FALLING);
    pinMode(MOTOR_DIR, OUTPUT);
    digitalWrite(MOTOR_ENB, HIGH); pinMode(MOTOR_ENB, OUTPUT); digitalWrite(MOTOR_ENB, HIGH);
+#ifndef STEP_SHIFT_REGISTERS
    for (unsigned i = 0; i < NUM_MOTORS; ++i) {
       pinMode(motor_step_pins[i], OUTPUT); }  // pulse 2 usec high to step
+#endif
    pinMode(A_ROTATE_INDEX, INPUT_PULLUP);
    pinMode(F_ROTATE_INDEX, INPUT_PULLUP);
 
    Serial.begin(115200);
    delay(500);
-   while (!Serial.available()) ; // wait for terminal emulator to connect and user to hit Enter
-   Serial.printf("*** AE prototype tester ***\ntimeunit is %d msec\n", timeunit_usec / 1000L);
+   if (!autostart_configured()) { // unless we're running headless,
+      while (!Serial.available()) ; // wait for terminal emulator to connect and user to hit Enter
+      flush_input(); }
+   Serial.printf("*** AE prototype tester ***\ntimeunit is %lu msec\n", timeunit_usec / 1000L);
 
    // create a map from motor number to motor descriptor
    for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
       int motornum = pmd->motor_number;
       if (motor_num_to_descr[motornum]) Serial.printf("ERROR: motor %u is duplicated!\n", motornum);
       motor_num_to_descr[motornum] = pmd; }
+   init_step_ports();
+   init_keywords();
+   watch_index_switches();
 
    static const char *intro[] = {
       "We assume the following neutral positions:\n",
@@ -365,13 +535,231 @@ void setup(void) {
       NULL };
    for (const char **msg = intro; *msg; ++msg)
       Serial.print(*msg);
-   motor_num_to_descr[H_R]->current_position = 45;
-   read_config(); }
+   set_neutral_positions();
+   read_config();
+   read_journal();
+   compile_scripts();
+   reset_stats(); }
+
+void set_neutral_positions(void) { // set the positions we assume on startup
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      pmd->current_position = 0;
+   motor_num_to_descr[H_R]->current_position = 45; }
+
+//****  the position journal
+
+// So that a restart can continue without homing, the positions of all the axles, which
+// include the states of the locks and meshes, are journaled in EEPROM after the config
+// block. Each record is written to the next of a ring of slots to spread the wear, and
+// has a sequence number and a checksum; the valid record with the highest sequence number
+// is the latest. When movements start from idle the latest record is first marked as
+// moving, and when they are finished and we're back at the command prompt a new record is
+// written. A record that is still marked as moving on startup means the power was lost
+// during a movement, or the movements were stopped, so the positions aren't known.
+
+#define JOURNAL_START 64     // the EEPROM address of the first slot, after the config block
+#define JOURNAL_DONE 0x5A    // record states
+#define JOURNAL_MOVING 0xA5  //   (not 0, so that EEPROM that was zeroed doesn't look like a record)
+
+struct journal_record_t {
+   byte state;               // JOURNAL_DONE or JOURNAL_MOVING; anything else is an empty slot
+   byte checksum;            // makes the 8-bit sum of everything after the state zero
+   uint32_t sequence;        // increases with each record
+   int16_t positions[NUM_MOTORS]; }; // the current_position of each motor
+
+struct journal_record_t journal;  // the latest record
+int journal_slot = -1;            // where it is, or -1 if there isn't one
+bool journal_marked = false;      // has it been marked as moving?
+bool positions_known = true;      // are the positions right, or were movements stopped midway?
+
+int journal_slots(void) {
+   return (EEPROM.length() - JOURNAL_START) / sizeof(struct journal_record_t); }
+
+int journal_address(int slot) {
+   return JOURNAL_START + slot * sizeof(struct journal_record_t); }
+
+byte journal_sum(struct journal_record_t *rec) { // the sum of everything after the state
+   byte sum = 0;
+   for (unsigned i = 1; i < sizeof(*rec); ++i) sum += ((byte *)rec)[i];
+   return sum; }
+
+void read_journal(void) { // find the latest record, and restore the positions from it if we can
+   struct journal_record_t rec;
+   for (int slot = 0; slot < journal_slots(); ++slot) {
+      for (unsigned i = 0; i < sizeof(rec); ++i)
+         ((byte *)&rec)[i] = EEPROM.read(journal_address(slot) + i);
+      if ((rec.state == JOURNAL_DONE || rec.state == JOURNAL_MOVING) && journal_sum(&rec) == 0
+            && (journal_slot < 0 || (int32_t)(rec.sequence - journal.sequence) > 0)) {
+         journal = rec;
+         journal_slot = slot; } }
+   if (journal_slot < 0) return;
+   if (journal.state == JOURNAL_MOVING) {
+      Serial.printf("*** the last movements didn't finish, so the positions are unknown: do \"home\" or \"reset\"\n");
+      journal_marked = true;
+      positions_known = false;
+      return; }
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      pmd->current_position = journal.positions[pmd->motor_number];
+   Serial.printf("positions restored from the journal\n"); }
+
+void journal_moving(void) { // movements are starting: mark the latest record
+   if (journal_slot < 0 || journal_marked) return;
+   EEPROM.update(journal_address(journal_slot), JOURNAL_MOVING);
+   journal_marked = true; }
+
+void journal_commit(void) { // the movements are done: write a new record if anything changed
+   if (!positions_known) return;
+   struct journal_record_t rec;
+   memset(&rec, 0, sizeof(rec));
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      rec.positions[pmd->motor_number] = pmd->current_position;
+   if (journal_slot >= 0 && !journal_marked && memcmp(rec.positions, journal.positions, sizeof(rec.positions)) == 0)
+      return; // nothing to do
+   rec.sequence = journal_slot >= 0 ? journal.sequence + 1 : 1;
+   rec.checksum = 0;
+   rec.checksum = -journal_sum(&rec);
+   rec.state = JOURNAL_DONE;
+   int slot = (journal_slot + 1) % journal_slots();
+   int addr = journal_address(slot);
+   EEPROM.update(addr, 0xff); // empty the slot while we write it,
+   for (unsigned i = 1; i < sizeof(rec); ++i)
+      EEPROM.update(addr + i, ((byte *)&rec)[i]);
+   EEPROM.update(addr, rec.state); // and make it valid only at the end
+   journal = rec;
+   journal_slot = slot;
+   journal_marked = false; }
+
+//****  trace logging
+
+// With debug level 2 or more, the motion code records binary events in a ring buffer
+// instead of printing, which takes constant time and doesn't stretch the time units.
+// The ring is drained to the console by the foreground whenever it is waiting, as lines
+// of "#T" followed by the record in hex, and "#D" followed by the count of events that
+// were dropped because the ring was full. trace_decode.py turns a console log into
+// readable events.
+
+enum trace_event_t { // trace event codes; keep trace_decode.py in sync
+   TR_QUEUE_CW = 1,  // queued a movement: motor, microsteps
+   TR_QUEUE_CCW,     // same, counter-clockwise
+   TR_SUBMIT,        // submitted a time unit: plan number, number of motors
+   TR_UNIT_START,    // the engine started a time unit: plan number, number of motors
+   TR_MOTOR_DONE,    // a motor finished its movement: motor, microsteps
+   TR_UNIT_END,      // the engine finished a time unit: plan number, microsteps
+   TR_IDLE,          // the engine has nothing more to do
+   TR_ABORT };       // the movements were aborted
+
+struct trace_t { // one trace record
+   uint8_t event;
+   uint8_t motor;    // or other small number
+   uint16_t count;   // a microstep count, or other number
+   uint32_t usec; }; // the time it happened
+#define TRACE_SIZE 512  // must be a power of 2
+struct trace_t trace_ring[TRACE_SIZE];
+volatile unsigned trace_head = 0, trace_tail = 0;
+volatile unsigned long trace_dropped = 0;
+
+void trace(int event, int motor, unsigned count) { // record an event; callable from interrupts
+   if (debug < 2) return;
+   uint32_t timenow = micros();
+   noInterrupts();
+   if (trace_head - trace_tail >= TRACE_SIZE) ++trace_dropped;
+   else {
+      struct trace_t *tp = &trace_ring[trace_head++ % TRACE_SIZE];
+      tp->event = event;
+      tp->motor = motor;
+      tp->count = count;
+      tp->usec = timenow; }
+   interrupts(); }
+
+void drain_trace(void) { // send trace records to the console, as much as can be done without waiting
+   while (trace_tail != trace_head && Serial.availableForWrite() > 24) {
+      struct trace_t *tp = &trace_ring[trace_tail % TRACE_SIZE];
+      Serial.printf("#T%02X%02X%04X%08lX\n", tp->event, tp->motor, tp->count, (unsigned long)tp->usec);
+      ++trace_tail; }
+   if (trace_dropped && Serial.availableForWrite() > 24) {
+      noInterrupts();
+      unsigned long dropped = trace_dropped;
+      trace_dropped = 0;
+      interrupts();
+      Serial.printf("#D%lu\n", dropped); } }
+
+//****  motion statistics
+
+// These counters are always kept, to show how well the step engine is keeping up.
+// "Lateness" is how long after its deadline a microstep was actually done.
+
+#define LATE_BUCKETS 12      // lateness histogram buckets: 0, 1, 2-3, 4-7, ... 1024+ usec
+#define OVERRUN_USEC 20      // a time unit whose last step is later than this has overrun
+
+struct { // the statistics since startup or "stats reset"
+   unsigned long reset_usec;          // when they were last reset
+   unsigned long units;               // time units done
+   unsigned long units_overrun;       // time units whose last step was late
+   unsigned long worst_overrun_usec;  // the latest any time unit ended
+   unsigned long units_from_idle;     // time units that started with the engine idle, not at a boundary
+   unsigned long interrupts;          // step engine interrupts
+   unsigned long interrupt_usec;      // time spent in them
+   unsigned long usteps;              // microsteps done
+   unsigned long late_histogram[LATE_BUCKETS];
+   unsigned long motor_usteps[NUM_MOTORS];      // microsteps done by each motor
+   unsigned long motor_worst_late[NUM_MOTORS];  // the latest step for each motor
+   unsigned long abort_checks;        // calls to check_abort()
+   unsigned long abort_check_usec;    // time spent in them
+   unsigned long worst_abort_check_usec;
+   unsigned long worst_poll_gap_usec; // the longest time between looks at the console while moving
+   unsigned long motor_faults;        // fault interrupts, which stopped the step engine
+   unsigned long over_limits;         // movements planned beyond a motor's acceleration or speed limit
+   unsigned long index_checks;        // index switch closings checked against the microsteps done
+   unsigned long lost_step_faults;    // and how many of those found lost steps
+   unsigned long timeline_starved;    // with STEP_TIMELINE, how often the interrupt had to compute step events
+} stats;
+
+void reset_stats(void) {
+   noInterrupts();
+   memset(&stats, 0, sizeof(stats));
+   stats.reset_usec = micros();
+   interrupts(); }
+
+void count_ustep(int motor_num, unsigned long late_usec) { // record the lateness of one microstep
+   ++stats.usteps;
+   ++stats.motor_usteps[motor_num];
+   if (late_usec > stats.motor_worst_late[motor_num]) stats.motor_worst_late[motor_num] = late_usec;
+   int bucket = late_usec ? 32 - __builtin_clz(late_usec) : 0;
+   ++stats.late_histogram[min(bucket, LATE_BUCKETS - 1)]; }
+
+void show_stats(void) {
+   unsigned long elapsed_usec = micros() - stats.reset_usec;
+   Serial.printf("in the last %lu msec: %lu time units, %lu overran by more than %d usec (worst %lu usec),"
+                 " %lu started from idle\n", elapsed_usec / 1000, stats.units, stats.units_overrun, OVERRUN_USEC,
+                 stats.worst_overrun_usec, stats.units_from_idle);
+   Serial.printf("  %lu microsteps in %lu interrupts (%lu.%02lu interrupts/step), which took %lu.%02lu%% of the time\n",
+                 stats.usteps, stats.interrupts,
+                 stats.usteps ? stats.interrupts / stats.usteps : 0, stats.usteps ? stats.interrupts * 100 / stats.usteps % 100 : 0,
+                 elapsed_usec ? (unsigned long)(stats.interrupt_usec * 100ULL / elapsed_usec) : 0,
+                 elapsed_usec ? (unsigned long)(stats.interrupt_usec * 10000ULL / elapsed_usec % 100) : 0);
+   Serial.printf("  step lateness in usec:");
+   for (int bucket = 0; bucket < LATE_BUCKETS; ++bucket)
+      if (stats.late_histogram[bucket])
+         Serial.printf(" %s%lu: %lu", bucket == LATE_BUCKETS - 1 ? ">=" : "<", bucket == LATE_BUCKETS - 1 ? 1UL << (bucket - 1) : 1UL << bucket,
+                       stats.late_histogram[bucket]);
+   Serial.printf("\n  check_abort: %lu calls, average %lu usec, worst %lu usec\n", stats.abort_checks,
+                 stats.abort_checks ? stats.abort_check_usec / stats.abort_checks : 0, stats.worst_abort_check_usec);
+   Serial.printf("  worst stop latency: %lu usec for ESC, and an interrupt for %lu motor faults\n",
+                 stats.worst_poll_gap_usec, stats.motor_faults);
+   Serial.printf("  index switches: %lu checks, %lu found lost steps\n", stats.index_checks, stats.lost_step_faults);
+#ifdef STEP_TIMELINE
+   Serial.printf("  step timeline: ran dry %lu times\n", stats.timeline_starved);
+#endif
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      if (stats.motor_usteps[pmd->motor_number])
+         Serial.printf("  motor %-4s %2d: %8lu microsteps, worst %lu usec late\n", pmd->axle_name, pmd->motor_number,
+                       stats.motor_usteps[pmd->motor_number], stats.motor_worst_late[pmd->motor_number]); }
 
 //****  command parsing routines
 
 void scan_commands(const char *cmds) ;
 #define CMDLENGTH 150
+#define SOH 0x01             // starts a binary frame: see the streaming protocol below
 static char prev_cmd[CMDLENGTH] = {0}, prev_prev_cmd[CMDLENGTH] = {0};
 
 void error(const char *msg, const char *info) {
@@ -383,12 +771,17 @@ void flush_input(void) {
    while (Serial.available()) Serial.read(); }
 
 void getstring(char *buf, unsigned buflen) { // get a command string from the keyboard
+   // (anything typed ahead, or sent early by a host program, is kept)
    unsigned ndx;
-   flush_input();
    Serial.print('>');
    for (ndx = 0; ndx < buflen - 1; ++ndx) {
-      while (Serial.available() == 0) ; // wait for a character
+      while (Serial.available() == 0) drain_trace(); // wait for a character
       char ch = Serial.read();
+      if (ch == SOH && ndx == 0) { // a host program is starting to stream binary frames
+         do_stream();
+         Serial.print('>');
+         --ndx;
+         continue; }
       if (ch == '\n') break;
       if (ch == '\b') { // backspace
          if (ndx > 0) ndx -= 2;  // remove a typed character
@@ -402,7 +795,7 @@ void getstring(char *buf, unsigned buflen) { // get a command string from the ke
    else {
       buf[ndx] = 0;
       strncpy(prev_prev_cmd, prev_cmd, sizeof(prev_prev_cmd)); // save prev prev command
-      strncpy(prev_cmd, buf, sizeof(prev_cmd)); } // save new one as prev command
+      strncpy(prev_cmd, buf, sizeof(prev_cmd) - 1); } // save new one as prev command (the last byte stays 0)
    //Serial.printf(">%s\n", buf);
 }
 
@@ -412,15 +805,39 @@ int wait_for_char(void) {
    return Serial.read(); }
 
 bool check_abort(void) { // check for conditions that abort the current movements
-   if (Serial.available()) { // (1) any character from the keyboard
+   unsigned long start_usec = micros();
+   console_poll();
+   bool abort = abort_requested();
+   if (abort) aborted = true;
+   else { // (the time to do the abort doesn't count)
+      unsigned long check_usec = micros() - start_usec;
+      ++stats.abort_checks;
+      stats.abort_check_usec += check_usec;
+      if (check_usec > stats.worst_abort_check_usec) stats.worst_abort_check_usec = check_usec; }
+   return abort; }
+
+bool abort_requested(void) {
+   if (streaming) { // (1) an abort frame from the host
+      if (stream_aborted()) {
+         Serial.println("aborted...");
+         stop_movements();
+         return true; } }
+   else if (key_waiting) { // (1) any character from the keyboard
+      key_waiting = false;
       Serial.println("aborted...");
       char chr = Serial.read();
+      flush_input(); // (don't do the rest of the line, or repeat the last command)
+      stop_movements();
       if (chr != '\e') // if it's not ESC ("stop NOW!")
-         do_script(home_commands.commands, false); // return everything to home position
+         do_home(); // return everything to home position
       return true; }
-   if (digitalRead(MOTOR_FAULT) == LOW) { // (2) a motor fault
+   if (fault_latched || digitalRead(MOTOR_FAULT) == LOW) { // (2) a motor fault
+      fault_latched = false;
       error("motor fault", "");
       return true; }
+   if (check_lost_steps(false)) { // (3) lost steps, if that should stop us
+      stop_movements();
+      return true; }
    return false; }
 
 void skip_blanks(const char **pptr) {
@@ -449,95 +866,925 @@ bool strmatch(const char *a, const char *b) {
       if (*a++ != *b++) return false;
    return *a == 0 && *b == 0; }
 
+// Commands, axle names, script names, and the keywords in the functional movement tables
+// are all looked up as whole words in one hash table that is built at startup. A keyword
+// is identified by the word and the context it is used in, which is either one of the
+// KW_ codes below or the address of a functional movement table. So any command line
+// is parsed in time proportional to its length, and no name can be a prefix of another.
+
+#define MAX_WORD 16            // the longest keyword, plus one
+#define KEYWORD_HASH_SIZE 256  // must be a power of 2, and well above the number of keywords
+#define KW_COMMANDS 1          // keyword contexts other than a functional movement table
+#define KW_SCRIPTS 2
+#define KW_ROTATE_AXLES 3
+#define KW_LIFT_AXLES 4
+
+struct keyword_t {
+   const char *word;           // the keyword, in any case
+   uintptr_t context;          // where it is used
+   void *value;                // what it means there
+} keyword_hash[KEYWORD_HASH_SIZE];
+
+bool word_is(const char *word, const char *keyword) { // case-insensitive compare
+   while (*word && tolower(*word) == tolower(*keyword)) ++word, ++keyword;
+   return *word == 0 && *keyword == 0; }
+
+unsigned hash_word(const char *word, uintptr_t context) { // FNV-1a of the lowercased word and the context
+   uint32_t hash = 2166136261u ^ (uint32_t)context;
+   while (*word) hash = (hash ^ tolower(*word++)) * 16777619u;
+   return (hash ^ (hash >> 16)) & (KEYWORD_HASH_SIZE - 1); }
+
+void add_keyword(const char *word, uintptr_t context, void *value) { // value must not be NULL
+   unsigned ndx = hash_word(word, context);
+   for (int tries = 0; tries < KEYWORD_HASH_SIZE; ++tries, ndx = (ndx + 1) & (KEYWORD_HASH_SIZE - 1)) {
+      struct keyword_t *kw = &keyword_hash[ndx];
+      if (!kw->word) { // an empty slot
+         kw->word = word;
+         kw->context = context;
+         kw->value = value;
+         return; }
+      if (kw->context == context && word_is(kw->word, word)) return; } // already there: keep the first
+   Serial.printf("ERROR: keyword table is full at %s\n", word); }
+
+void *find_keyword(const char *word, uintptr_t context) { // look up a word, or return NULL
+   for (unsigned ndx = hash_word(word, context); keyword_hash[ndx].word; ndx = (ndx + 1) & (KEYWORD_HASH_SIZE - 1))
+      if (keyword_hash[ndx].context == context && word_is(keyword_hash[ndx].word, word))
+         return keyword_hash[ndx].value;
+   return NULL; }
+
+int scan_word(const char **pptr, char *word) { // scan an alphanumeric word, and return its length
+   skip_blanks(pptr);
+   int len = 0;
+   for (; isalnum(**pptr); ++*pptr)
+      if (len < MAX_WORD - 1) word[len++] = **pptr;
+   word[len] = 0;
+   skip_blanks(pptr);
+   return len; }
+
+void *scan_keyword(const char **pptr, uintptr_t context) { // scan a word and look it up in a context
+   const char *savep = *pptr;
+   char word[MAX_WORD];
+   void *value = scan_word(pptr, word) ? find_keyword(word, context) : NULL;
+   if (!value) *pptr = savep; // leave it for the error message
+   return value; }
+
 // Scan for an axle name of a particular movement type: LIFT or ROTATE.
 // Return the pointer to the motor descriptor, or NULL if not found
 struct motord_t *scan_axlename(const char **pptr, enum movement_t which) {
-   const char *savep = *pptr;
-   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
-      if (scan_key(pptr, pmd->axle_name) && pmd->motor_type == which) {
-         return pmd; }
-      *pptr = savep; }
-   error("bad motor name", *pptr);
-   return NULL; }
+   struct motord_t *pmd = (struct motord_t *) scan_keyword(pptr, which == ROTATE ? KW_ROTATE_AXLES : KW_LIFT_AXLES);
+   if (!pmd) error("bad motor name", *pptr);
+   return pmd; }
 
 //****  movement queuing and execution
 
+// The step engine runs from a timer interrupt. Each interrupt does the microsteps that
+// have become due, then reprograms the timer to fire exactly when the next one is due.
+// The foreground only queues movements, starts the engine, and watches for aborts.
+//
+// The movements for each time unit are collected into a plan, and the engine works
+// through a queue of plans. When one time unit ends the next one starts right at the
+// boundary, while the foreground is already parsing and queueing the one after that.
+//
+// Every microstep has an absolute deadline relative to the start of the time unit:
+// step k of n is due at k * duration / n, kept exact with a Bresenham-style remainder.
+// A late interrupt therefore never delays the steps that follow, and the last step
+// of every motor lands exactly at the end of its movement.
+//
+// Each movement normally takes the whole time unit, but it can instead be given its own
+// duration, and be made to start when another motor's movement ends. Because the step
+// timing is exact, that is all worked out when the time unit is submitted, and the engine
+// just sees movements with start times. The time unit ends when the last movement does.
+//
+// Motors with an acceleration limit instead follow a symmetric trapezoidal speed profile
+// that fits the same n steps into the same duration: accelerate at the limit, cruise,
+// then decelerate to a stop exactly at the boundary. Step k is due when the position
+// on that profile reaches k, which is computed from the inverse of the profile.
+
+#define PLAN_QUEUE_SIZE 4    // how many time units can be queued, including the one being done
+
+struct plan_move_t { // one motor's movement in a time unit
+   struct motord_t *pmd;
+   bool clockwise;
+   unsigned usteps;
+   unsigned long start_usec;      // when it starts
+   unsigned long duration_usec;   // how long it takes, or 0 for the whole time unit
+   struct motord_t *after;        // if not NULL, it starts when this motor's movement ends
+   struct step_profile_t profile;
+#ifdef STEP_TIMELINE
+   unsigned usteps_timed;         // how many of its steps are in the step timeline,
+   unsigned long next_ustep_usec; //   when the next one is due,
+   unsigned ustep_interval_err;   //   and the accumulated fractional part of the interval
+#endif
+};
+
+struct plan_t { // all the movements for a time unit
+   unsigned long duration_usec;
+   int num_moves;
+   struct plan_move_t moves[NUM_MOTORS];
+} plans[PLAN_QUEUE_SIZE];
+volatile unsigned plan_head = 0;  // the plan being filled by the foreground is plans[plan_head % PLAN_QUEUE_SIZE]
+volatile unsigned plan_tail = 0;  // the plan being done by the step engine is plans[plan_tail % PLAN_QUEUE_SIZE]
+volatile bool engine_running = false;
+#define filling_plan (&plans[plan_head % PLAN_QUEUE_SIZE])
+
+unsigned long schedule_moves(struct plan_t *plan, unsigned long duration_usec) { // when each movement starts and how long it takes
+   // return when the last one ends, which is the duration of the time unit
+   for (int ndx = 0; ndx < plan->num_moves; ++ndx) {
+      struct plan_move_t *move = &plan->moves[ndx];
+      if (move->duration_usec == 0) move->duration_usec = duration_usec;
+      move->start_usec = ULONG_MAX; } // not yet known
+   unsigned long end_usec = 0;
+   for (int scheduled = 0; scheduled < plan->num_moves; ) { // until all the start times are known
+      int progress = 0;
+      for (int ndx = 0; ndx < plan->num_moves; ++ndx) {
+         struct plan_move_t *move = &plan->moves[ndx];
+         if (move->start_usec != ULONG_MAX) continue;
+         unsigned long start_usec = 0; // when it's not after anything, or after a motor that isn't moving
+         for (int dep = 0; move->after && dep < plan->num_moves; ++dep)
+            if (plan->moves[dep].pmd == move->after)
+               start_usec = plan->moves[dep].start_usec == ULONG_MAX ? ULONG_MAX
+                            : plan->moves[dep].start_usec + plan->moves[dep].duration_usec;
+         if (start_usec == ULONG_MAX) continue; // its dependency isn't scheduled yet
+         move->start_usec = start_usec;
+         end_usec = max(end_usec, start_usec + move->duration_usec);
+         ++progress; }
+      if (progress == 0) { // the rest depend on each other
+         for (int ndx = 0; ndx < plan->num_moves; ++ndx)
+            if (plan->moves[ndx].start_usec == ULONG_MAX) {
+               Serial.printf("** warning: circular \"after\" for axle %s\n", plan->moves[ndx].pmd->axle_name);
+               plan->moves[ndx].after = NULL; }
+         continue; }
+      scheduled += progress; }
+   return end_usec; }
+
+void plan_profile(struct plan_move_t *move) { // compute the step spacing for a movement
+   struct motord_t *pmd = move->pmd;
+   struct step_profile_t *pp = &move->profile;
+   unsigned long duration_usec = move->duration_usec;
+   pp->start_usec = move->start_usec;
+   pp->duration_usec = duration_usec;
+   pp->ramped = pmd->accel != 0;
+   if (!pp->ramped) { // evenly spaced
+      pp->ustep_interval_usec = duration_usec / move->usteps;
+      pp->ustep_interval_rem = duration_usec % move->usteps;
+      return; }
+   float T = duration_usec, n = move->usteps;
+   float a = pmd->accel * 1e-12f; // in microsteps/usec/usec
+   float ramp_usec = (T - sqrtf(max(T * T - 4 * n / a, 0.0f))) / 2; // from n = a * t * (T - t)
+   if (ramp_usec >= T / 2) { // can't make it at that acceleration: use a triangular profile
+      ramp_usec = T / 2;
+      a = 4 * n / (T * T);
+      Serial.printf("** warning: axle %s needs %lu usteps/sec/sec for this time unit\n",
+                    pmd->axle_name, (unsigned long)(a * 1e12f));
+      ++stats.over_limits; }
+   float velocity = a * ramp_usec; // peak velocity in microsteps/usec
+   if (pmd->max_velocity && velocity * 1e6f > pmd->max_velocity) {
+      ++stats.over_limits;
+      Serial.printf("** warning: axle %s needs %lu usteps/sec for this time unit\n",
+                    pmd->axle_name, (unsigned long)(velocity * 1e6f)); }
+   pp->ramp_usec = ramp_usec;
+   pp->ramp_usteps = a * ramp_usec * ramp_usec / 2;
+   pp->ramp_factor = 2 / a;
+   pp->cruise_usec_per_ustep = 1 / velocity; }
+
+unsigned long ramp_deadline(struct step_profile_t *pp, unsigned usteps, unsigned k) { // when step k is due on the speed profile
+   float n = usteps;
+   if (k <= pp->ramp_usteps) // accelerating
+      return sqrtf(k * pp->ramp_factor);
+   if (k < n - pp->ramp_usteps) // cruising
+      return pp->ramp_usec + (k - pp->ramp_usteps) * pp->cruise_usec_per_ustep;
+   if (k >= n) return pp->duration_usec; // the last step is exactly at the end
+   return pp->duration_usec - sqrtf((n - k) * pp->ramp_factor); } // decelerating
+
+void first_deadline(struct step_profile_t *pp, unsigned usteps, unsigned long *next_usec, unsigned *err) {
+   if (pp->ramped) *next_usec = pp->start_usec + ramp_deadline(pp, usteps, 1);
+   else { // the first step is due 1/n into the movement
+      *next_usec = pp->start_usec + pp->ustep_interval_usec;
+      *err = pp->ustep_interval_rem; } }
+
+void advance_deadline(struct step_profile_t *pp, unsigned usteps, unsigned done, unsigned long *next_usec, unsigned *err) {
+   // after "done" steps, when is the next one due?
+   if (pp->ramped) *next_usec = pp->start_usec + ramp_deadline(pp, usteps, done + 1);
+   else {
+      *next_usec += pp->ustep_interval_usec; // advance the deadline, not "now"
+      if ((*err += pp->ustep_interval_rem) >= usteps) {
+         *err -= usteps;
+         ++*next_usec; } } }
+
+// The STEP pulses for all the motors that are due together are done with one write to
+// each port's set register and one write to its clear register. Motors are grouped by
+// direction, so the shared MOTOR_DIR line changes at most once per interrupt.
+// With STEP_SHIFT_REGISTERS a "port" is instead one 32-bit word of the shift register
+// chain, and the set and clear are each one shift of the whole chain.
+
+struct step_port_t {
+   volatile uint32_t *set_reg;    // writing a 1 bit sets the pin high
+   volatile uint32_t *clear_reg;  // writing a 1 bit sets the pin low
+} step_ports[MAX_STEP_PORTS];
+int num_step_ports = 0;
+bool motor_dir_state = LOW;       // the current state of the MOTOR_DIR line
+
+void init_step_ports(void) { // find the GPIO port and bit for each motor's STEP pin
+#ifdef STEP_SHIFT_REGISTERS
+   static const uint32_t no_steps[MAX_STEP_PORTS] = {0 };
+   hal_shift_begin(STEP_LATCH_PIN);
+   hal_shift_steps(STEP_LATCH_PIN, no_steps, MAX_STEP_PORTS); // the outputs are random at power-up
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
+      pmd->step_port = pmd->motor_number / 32;
+      pmd->step_mask = 1ul << (pmd->motor_number % 32); }
+   num_step_ports = MAX_STEP_PORTS;
+#elif defined(HAL_STEP_PLAYER)
+   init_player(); // (which has its own ports)
+   num_step_ports = HAL_PLAYER_PORTS;
+#else
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
+      int pin = motor_step_pins[pmd->motor_number];
+      volatile uint32_t *set_reg, *clear_reg;
+      hal_step_port(pin, &set_reg, &clear_reg, &pmd->step_mask);
+      int port;
+      for (port = 0; port < num_step_ports && step_ports[port].set_reg != set_reg; ++port) ;
+      if (port == num_step_ports) { // a new port
+         if (num_step_ports >= MAX_STEP_PORTS) {
+            Serial.printf("ERROR: too many step ports for motor %d\n", pmd->motor_number);
+            continue; }
+         step_ports[port].set_reg = set_reg;
+         step_ports[port].clear_reg = clear_reg;
+         ++num_step_ports; }
+      pmd->step_port = port; }
+#endif
+   digitalWrite(MOTOR_DIR, motor_dir_state); }
+
+void pulse_steps(uint32_t due[2][MAX_STEP_PORTS]) { // do one microstep for all motors in the due masks
+   for (int group = 0; group < 2; ++group) { // first the motors that don't need a DIR change
+      bool dir = group == 0 ? motor_dir_state : !motor_dir_state;
+      uint32_t *masks = due[dir];
+      bool any = false;
+      for (int port = 0; port < num_step_ports; ++port) any |= masks[port] != 0;
+      if (!any) continue;
+      if (dir != motor_dir_state) {
+         digitalWriteFast(MOTOR_DIR, dir);
+         motor_dir_state = dir;
+         delayMicroseconds(1); } // DRV8825 spec: DIR setup min 650 nsec before STEP rises
+#ifdef STEP_SHIFT_REGISTERS
+      static const uint32_t no_steps[MAX_STEP_PORTS] = {0 };
+      hal_shift_steps(STEP_LATCH_PIN, masks, num_step_ports);
+      delayMicroseconds(3); // TI DRV8825 stepper motor controller spec: pulse min 1.9 usec high
+      hal_shift_steps(STEP_LATCH_PIN, no_steps, num_step_ports);
+#else
+      for (int port = 0; port < num_step_ports; ++port)
+         if (masks[port]) hal_port_write(step_ports[port].set_reg, masks[port]);
+      delayMicroseconds(3); // TI DRV8825 stepper motor controller spec: pulse min 1.9 usec high
+      for (int port = 0; port < num_step_ports; ++port)
+         if (masks[port]) hal_port_write(step_ports[port].clear_reg, masks[port]);
+#endif
+   } }
+
+// The interrupt routine only looks at the motors that are moving in the current time unit,
+// whose state is packed together in active_motors[] when the time unit starts. A motor
+// that is done is removed by moving the last one into its place, so the time an interrupt
+// takes depends on how many motors are moving, not on how many there are.
+
+struct active_motor_t { // what the step interrupt needs for one moving motor
+   unsigned long next_ustep_usec;       // when its next step is due, relative to the start of the time unit
+   unsigned usteps_needed, usteps_done; // how many microsteps it needs, and has done
+   unsigned ustep_interval_err;         // the accumulated fractional part of the interval, 0..usteps_needed-1
+   uint32_t step_mask;                  // its STEP bit,
+   byte step_port;                      //   in which of the step_ports[]
+   bool clockwise;
+   struct step_profile_t *profile;      // how the steps are spaced, in the plan
+   struct motord_t *pmd; }
+active_motors[NUM_MOTORS];              // the first motors_moving of these
+
+unsigned long start_plan(void) { // load the next plan into the active motors, and return its first deadline
+   struct plan_t *plan = &plans[plan_tail % PLAN_QUEUE_SIZE];
+   unsigned long first_usec = ULONG_MAX;
+   for (int ndx = 0; ndx < plan->num_moves; ++ndx) {
+      struct plan_move_t *move = &plan->moves[ndx];
+      struct motord_t *pmd = move->pmd;
+      struct active_motor_t *am = &active_motors[ndx];
+      pmd->clockwise = am->clockwise = move->clockwise;
+      pmd->usteps_needed = am->usteps_needed = move->usteps;
+      pmd->usteps_done = am->usteps_done = 0;
+      am->step_mask = pmd->step_mask;
+      am->step_port = pmd->step_port;
+      am->profile = &move->profile;
+      am->pmd = pmd;
+      first_deadline(am->profile, am->usteps_needed, &am->next_ustep_usec, &am->ustep_interval_err);
+      if (am->next_ustep_usec < first_usec) first_usec = am->next_ustep_usec;
+      pmd->moving = true; }
+   motors_moving = plan->num_moves;
+   unit_duration_usec = plan->duration_usec;
+   unit_usteps = 0;
+   trace(TR_UNIT_START, plan_tail % PLAN_QUEUE_SIZE, plan->num_moves);
+   return first_usec; }
+
+void step_isr(void) { // do all the microsteps that are due now
+   unsigned long isr_start_usec = micros();
+   unsigned long timenow = isr_start_usec - unit_start_usec; // time since the start of the time unit
+   unsigned long next_usec = ULONG_MAX; // when the next microstep will be due
+   uint32_t due[2][MAX_STEP_PORTS] = {{0 } }; // STEP pins to pulse, by direction and port
+   for (int ndx = 0; ndx < motors_moving; ) {
+      struct active_motor_t *am = &active_motors[ndx];
+      if (timenow >= am->next_ustep_usec) {
+         due[am->clockwise][am->step_port] |= am->step_mask; // do one microstep
+         count_ustep(am->pmd->motor_number, timenow - am->next_ustep_usec);
+         ++total_usteps;
+         ++unit_usteps;
+         am->pmd->net_usteps += am->clockwise ? 1 : -1;
+         if (++am->usteps_done >= am->usteps_needed) { // if this motor is done
+            retire_motor(ndx); // (which puts another one at ndx)
+            continue; }
+         advance_deadline(am->profile, am->usteps_needed, am->usteps_done, &am->next_ustep_usec, &am->ustep_interval_err); }
+      if (am->next_ustep_usec < next_usec) next_usec = am->next_ustep_usec;
+      ++ndx; }
+   pulse_steps(due);
+   ++stats.interrupts;
+   if (motors_moving == 0 && !finish_unit(timenow, &next_usec)) { // this time unit is done, and so are we
+      stats.interrupt_usec += micros() - isr_start_usec;
+      return; }
+   timenow = micros() - unit_start_usec; // account for the time we spent here
+   next_usec = next_usec > timenow + MIN_TIMER_USEC ? next_usec - timenow : MIN_TIMER_USEC;
+   step_timer.begin(step_isr, next_usec);
+   stats.interrupt_usec += micros() - isr_start_usec; }
+
+void retire_motor(int ndx) { // remove a motor from the active ones (with interrupts off)
+   struct active_motor_t *am = &active_motors[ndx];
+   am->pmd->usteps_done = am->usteps_done;
+   am->pmd->moving = false;
+   trace(TR_MOTOR_DONE, am->pmd->motor_number, am->usteps_done);
+   *am = active_motors[--motors_moving]; }
+
+unsigned stop_motor(struct motord_t *pmd) { // stop a motor now, and return how many microsteps it did
+   // (with interrupts off) the step engine still finishes the time unit
+#if defined(HAL_STEP_PLAYER) // the player plays what has already been made into its entries
+   account_entries(); // (so its microsteps done are up to date)
+   if (pmd->moving) {
+      pmd->moving = false;
+      --motors_moving;
+      unplay_motor(pmd); }
+#elif defined(STEP_TIMELINE) // the timeline's interrupt routine uses the motor descriptors
+   if (pmd->moving) {
+      pmd->moving = false;
+      --motors_moving; }
+#else
+   for (int ndx = 0; ndx < motors_moving; ++ndx)
+      if (active_motors[ndx].pmd == pmd) retire_motor(ndx);
+#endif
+   return pmd->usteps_done; }
+
+bool finish_unit(unsigned long timenow, unsigned long *next_usec) { // the time unit is done: start the next one
+   // return false if there's nothing more queued, and the step engine has stopped
+   trace(TR_UNIT_END, plan_tail % PLAN_QUEUE_SIZE, unit_usteps);
+   ++stats.units;
+   if (timenow > unit_duration_usec + OVERRUN_USEC) {
+      ++stats.units_overrun;
+      if (timenow - unit_duration_usec > stats.worst_overrun_usec)
+         stats.worst_overrun_usec = timenow - unit_duration_usec; }
+   if (++plan_tail == plan_head) {
+      trace(TR_IDLE, 0, 0);
+      engine_running = false;
+      end_stepping();
+      return false; }
+   unit_start_usec += unit_duration_usec; // the next one starts exactly at the boundary
+   *next_usec = start_plan();
+   return true; }
+
+//****  the step timeline
+
+// With STEP_TIMELINE the step times aren't computed in the interrupt routine. Instead the
+// foreground, whenever it is waiting anyway, works through the queued plans with the same
+// deadline calculations and puts every microstep, in time order, into a ring of step events.
+// The interrupt routine then only has to pulse the STEP pins of the events that are due,
+// and look at the next event for when to fire again, which takes the same short time no
+// matter how many motors are moving or how they are ramped. If the foreground falls behind,
+// the interrupt routine computes some events itself, and "stats" counts how often.
+//
+// On the Teensy 4.1 the step events are instead played by the hardware player in hal.h,
+// so there is no interrupt for the steps at all. The events are turned into player
+// entries, each an image of the ports of the STEP pins and MOTOR_DIR at some time: one
+// that raises the STEP pins of the events that are due together in the same direction,
+// one PLAYER_PULSE_USEC later that lowers them again, one that changes MOTOR_DIR before
+// the pulses in the other direction, fillers for gaps longer than the timer can count,
+// and one at the end of each time unit. A slow periodic interrupt then catches up with
+// what has been played, doing the bookkeeping that the step interrupt would have for the
+// microsteps and the time units, and makes entries itself if the foreground fell behind.
+// When nothing more is queued, entries that just hold the pins keep the player going for
+// a little while, so a time unit that is queued by then still follows on without a gap.
+// A motor stopped at its switch has its STEP bit cleared from the entries not yet played,
+// and if that ends the time unit early, the player starts over with the next one.
+
+#ifdef STEP_TIMELINE
+#define TIMELINE_SIZE 8192   // step events in the ring
+#define TIMELINE_CHUNK 64    // how many are computed with interrupts off
+
+struct step_event_t {
+   unsigned long usec;       // when it's due, relative to the start of its time unit
+   byte motor;               // which motor to step
+   byte unit;                // the low byte of the plan number it's in
+#ifdef HAL_STEP_PLAYER
+   bool clockwise;           // which way
+   unsigned short late_usec; // how late its entry is
+#endif
+}
+timeline[TIMELINE_SIZE];
+volatile unsigned timeline_head = 0; // the next event to be computed goes at timeline[timeline_head % TIMELINE_SIZE]
+volatile unsigned timeline_tail = 0; // the next event to be played is at timeline[timeline_tail % TIMELINE_SIZE]
+unsigned timeline_plan = 0;          // the plan whose events are being computed
+bool timeline_started = false;       // have its movements been set up for that?
+
+void compute_events(int max_events) { // put up to this many more step events into the timeline
+   // (with interrupts off, from either the foreground or the interrupt routine)
+   if ((int)(plan_tail - timeline_plan) > 0) { // the engine ended that time unit early
+      timeline_plan = plan_tail;
+      timeline_started = false; }
+   for (int count = 0; count < max_events && timeline_plan != plan_head
+         && timeline_head - timeline_tail < TIMELINE_SIZE; ++count) {
+      struct plan_t *plan = &plans[timeline_plan % PLAN_QUEUE_SIZE];
+      if (!timeline_started) {
+         for (int ndx = 0; ndx < plan->num_moves; ++ndx) {
+            struct plan_move_t *move = &plan->moves[ndx];
+            move->usteps_timed = 0;
+            first_deadline(&move->profile, move->usteps, &move->next_ustep_usec, &move->ustep_interval_err); }
+         timeline_started = true; }
+      struct plan_move_t *next = NULL; // the movement whose next step is due first
+      for (int ndx = 0; ndx < plan->num_moves; ++ndx) {
+         struct plan_move_t *move = &plan->moves[ndx];
+         if (move->usteps_timed < move->usteps && (!next || move->next_ustep_usec < next->next_ustep_usec)) next = move; }
+      if (!next) { // all of this plan is in the timeline
+         ++timeline_plan;
+         timeline_started = false;
+         continue; }
+      struct step_event_t *ev = &timeline[timeline_head++ % TIMELINE_SIZE];
+      ev->usec = next->next_ustep_usec;
+      ev->motor = next->pmd->motor_number;
+      ev->unit = timeline_plan;
+#ifdef HAL_STEP_PLAYER
+      ev->clockwise = next->clockwise;
+#endif
+      if (++next->usteps_timed < next->usteps)
+         advance_deadline(&next->profile, next->usteps, next->usteps_timed, &next->next_ustep_usec, &next->ustep_interval_err); } }
+
+#ifndef HAL_STEP_PLAYER
+void fill_timeline(void) { // foreground: compute step events until the timeline is full, or there are no more
+   while (timeline_plan != plan_head && timeline_head - timeline_tail < TIMELINE_SIZE) {
+      noInterrupts();
+      compute_events(TIMELINE_CHUNK);
+      interrupts(); } }
+
+void timeline_isr(void) { // do the microsteps of the events that are due now
+   unsigned long isr_start_usec = micros();
+   unsigned long timenow = isr_start_usec - unit_start_usec; // time since the start of the time unit
+   unsigned long next_usec = 0;
+   uint32_t due[2][MAX_STEP_PORTS] = {{0 } };
+   if (timeline_tail == timeline_head) { // the foreground didn't keep up
+      ++stats.timeline_starved;
+      compute_events(TIMELINE_CHUNK); }
+   while (timeline_tail != timeline_head) {
+      struct step_event_t *ev = &timeline[timeline_tail % TIMELINE_SIZE];
+      byte age = (byte)plan_tail - ev->unit;
+      if (age != 0) { // not in this time unit
+         if (age < 128) { // left over from one that ended early, when a motor was stopped at its switch
+            ++timeline_tail;
+            continue; }
+         break; } // (the next one)
+      next_usec = ev->usec;
+      if (next_usec > timenow) break;
+      struct motord_t *pmd = motor_num_to_descr[ev->motor];
+      if (due[pmd->clockwise][pmd->step_port] & pmd->step_mask) break; // it's late, and its next step is due too
+      ++timeline_tail;
+      if (!pmd->moving) continue; // (it was stopped)
+      due[pmd->clockwise][pmd->step_port] |= pmd->step_mask;
+      count_ustep(pmd->motor_number, timenow - next_usec);
+      ++total_usteps;
+      ++unit_usteps;
+      pmd->net_usteps += pmd->clockwise ? 1 : -1;
+      if (++pmd->usteps_done >= pmd->usteps_needed) {
+         pmd->moving = false;
+         --motors_moving;
+         trace(TR_MOTOR_DONE, pmd->motor_number, pmd->usteps_done); } }
+   pulse_steps(due);
+   ++stats.interrupts;
+   if (motors_moving == 0) {
+      if (!finish_unit(timenow, &next_usec)) {
+         timeline_tail = timeline_head; // (anything left is from a motor that was stopped)
+         stats.interrupt_usec += micros() - isr_start_usec;
+         return; } }
+   timenow = micros() - unit_start_usec; // account for the time we spent here
+   next_usec = next_usec > timenow + MIN_TIMER_USEC ? next_usec - timenow : MIN_TIMER_USEC;
+   step_timer.begin(timeline_isr, next_usec);
+   stats.interrupt_usec += micros() - isr_start_usec; }
+
+void start_stepping(unsigned long first_usec) { // start the step engine's interrupts for the first deadline
+   compute_events(TIMELINE_CHUNK); // (the rest are done by submit_movements(), or while we wait)
+   step_timer.begin(timeline_isr, max(first_usec, (unsigned long)MIN_TIMER_USEC)); }
+
+void end_stepping(void) { // stop the step engine's interrupts
+   step_timer.end(); }
+
+#define account_entries()
+
+#else // the hardware player
+
+#define PLAYER_TICK_USEC 500    // how often the bookkeeping interrupt happens
+#define PLAYER_LEAD_USEC 2000   // how far ahead of the player the entries are always made
+#define PLAYER_PULSE_USEC 3     // TI DRV8825 stepper motor controller spec: pulse min 1.9 usec high
+#define PLAYER_GAP_USEC 2       // between entries: min 1.9 usec low, and DIR setup min 650 nsec before STEP rises
+#define PLAYER_MAX_USEC 10000   // the longest time between entries, within what the 16-bit timer can count
+#define PLAYER_MAX_EVENTS 0xfe  // the most step events one entry can finish,
+#define PLAYER_UNIT_END 0xff    //   or this for the entry at the end of a time unit
+
+uint16_t player_intervals[HAL_PLAYER_SIZE];    // timer ticks - 1 before the entry two further on; see hal.h
+uint32_t player_images[HAL_PLAYER_SIZE][HAL_PLAYER_PORTS]; // what the ports are set to
+byte player_events[HAL_PLAYER_SIZE];           // how many step events each entry finishes, or PLAYER_UNIT_END
+unsigned player_head = 0;      // the next entry to be made is player_images[player_head % HAL_PLAYER_SIZE] etc.
+unsigned player_done = 0;      // the next one to be accounted for as played
+uint16_t player_first[2];      // the timer's compare values for the first two entries
+unsigned long player_usec;     // when the last entry was made for, since the player started,
+unsigned long player_recent_usec[4]; //   and the last few, at player_head % 4
+unsigned long player_ticks_rem; // the fraction of a timer tick that is left over, in millionths
+unsigned long player_start_usec; // when the player started
+unsigned player_plan;          // the plan whose step events are being made into entries,
+unsigned long player_unit_usec; //   and when its time unit starts
+unsigned timeline_built;       // the next step event to be made into an entry
+bool player_dir;               // MOTOR_DIR as of the last entry made
+uint32_t player_dir_mask[HAL_PLAYER_PORTS]; // the MOTOR_DIR pin in the ports
+
+unsigned long later_usec(unsigned long a, unsigned long b) { // the later of two times
+   return (long)(a - b) > 0 ? a : b; }
+
+void init_player(void) { // give the STEP pins and MOTOR_DIR to the player
+   int port;
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
+      hal_player_pin(motor_step_pins[pmd->motor_number], &port, &pmd->step_mask);
+      pmd->step_port = port; }
+   uint32_t dir_mask;
+   hal_player_pin(MOTOR_DIR, &port, &dir_mask);
+   player_dir_mask[port] = dir_mask;
+   player_dir = motor_dir_state;
+   hal_player_begin(player_intervals, player_images);
+   stop_player(); }
+
+void stop_player(void) { // stop the player, with the STEP pins low
+   uint32_t rest[HAL_PLAYER_PORTS];
+   for (int port = 0; port < HAL_PLAYER_PORTS; ++port)
+      rest[port] = player_dir ? player_dir_mask[port] : 0;
+   hal_player_stop(rest); }
+
+void add_entry(unsigned long usec, const uint32_t *steps, byte events) { // make the next entry for this time
+   unsigned ndx = player_head % HAL_PLAYER_SIZE;
+   for (int port = 0; port < HAL_PLAYER_PORTS; ++port)
+      player_images[ndx][port] = (player_dir ? player_dir_mask[port] : 0) | (steps ? steps[port] : 0);
+   player_events[ndx] = events;
+   unsigned long long ticks = (unsigned long long)(usec - player_usec) * HAL_PLAYER_TICKS_PER_SEC + player_ticks_rem;
+   unsigned interval = ticks / 1000000; // since the last entry
+   player_ticks_rem = ticks % 1000000;
+   if (player_head < 2) player_first[player_head] = player_head == 0 ? interval : interval - 1;
+   else player_intervals[(player_head - 2) % HAL_PLAYER_SIZE] = interval - 1;
+   player_usec = player_recent_usec[player_head % 4] = usec;
+   ++player_head; }
+
+bool player_behind(void) { // aren't the entries far enough ahead of the player?
+   // (measured to the entry before the last two, which the interval for the next entry goes with)
+   return player_head < 3
+          || (long)(player_recent_usec[(player_head - 3) % 4] - (micros() - player_start_usec)) < PLAYER_LEAD_USEC; }
+
+int build_entries(int max_entries) { // make up to this many more entries from the step events, and return how many
+   // (with interrupts off, from either the foreground or the interrupt routine)
+   int count = 0;
+   while (count < max_entries && player_head - player_done <= HAL_PLAYER_SIZE - 3) {
+      if (timeline_built == timeline_head) compute_events(TIMELINE_CHUNK);
+      struct step_event_t *ev = timeline_built != timeline_head ? &timeline[timeline_built % TIMELINE_SIZE] : NULL;
+      if (player_plan != plan_head && (ev ? ev->unit != (byte)player_plan : timeline_plan != player_plan)) {
+         // all of that plan's step events are in entries, so end its time unit
+         unsigned long end_usec = later_usec(player_unit_usec + plans[player_plan % PLAN_QUEUE_SIZE].duration_usec,
+                                             player_usec + PLAYER_GAP_USEC);
+         if (end_usec - player_usec > PLAYER_MAX_USEC) add_entry(player_usec + PLAYER_MAX_USEC, NULL, 0); // (a filler)
+         else {
+            add_entry(end_usec, NULL, PLAYER_UNIT_END);
+            player_unit_usec = end_usec; // (the next one starts then)
+            ++player_plan; }
+         ++count;
+         continue; }
+      if (!ev) { // (the timeline is full, or nothing more is queued)
+         if (player_plan != plan_head || !player_behind()) break;
+         add_entry(player_usec + PLAYER_TICK_USEC, NULL, 0); // hold the pins as they are for a while
+         ++count;
+         continue; }
+      unsigned long due_usec = player_unit_usec + ev->usec;
+      unsigned long usec = later_usec(ev->clockwise != player_dir ? due_usec - PLAYER_GAP_USEC : due_usec,
+                                      player_usec + PLAYER_GAP_USEC);
+      if (usec - player_usec > PLAYER_MAX_USEC) usec = player_usec + PLAYER_MAX_USEC; // (a filler)
+      else if (ev->clockwise != player_dir) player_dir = ev->clockwise; // change MOTOR_DIR first
+      else { // the STEP pulses of this event, and of the ones after it that are due by then
+         uint32_t steps[HAL_PLAYER_PORTS] = {0 };
+         unsigned events = 0;
+         for (unsigned ndx = timeline_built; ndx != timeline_head && events < PLAYER_MAX_EVENTS; ++ndx, ++events) {
+            struct step_event_t *next = &timeline[ndx % TIMELINE_SIZE];
+            unsigned long late_usec = usec - (player_unit_usec + next->usec);
+            if (next->unit != ev->unit || (long)late_usec < 0) break; // (it isn't due yet)
+            struct motord_t *pmd = motor_num_to_descr[next->motor];
+            if (next->unit == (byte)plan_tail && !pmd->moving) continue; // (it was stopped, so it doesn't step)
+            if (next->clockwise != player_dir || steps[pmd->step_port] & pmd->step_mask) break; // (that's for the next pulse)
+            steps[pmd->step_port] |= pmd->step_mask;
+            next->late_usec = min(late_usec, 0xffffUL); }
+         timeline_built += events;
+         add_entry(usec, steps, events);
+         usec += PLAYER_PULSE_USEC; } // and the end of the pulses
+      add_entry(usec, NULL, 0);
+      ++count; }
+   return count; }
+
+void fill_timeline(void) { // foreground: make entries until the rings are full, or there are no more
+   for (int made = 1; made; ) {
+      noInterrupts();
+      made = engine_running ? build_entries(TIMELINE_CHUNK) : 0;
+      interrupts(); } }
+
+void start_player(void) { // start the player on the plan the step engine is starting (with interrupts off)
+   timeline_tail = timeline_built = timeline_head;
+   timeline_plan = player_plan = plan_tail;
+   timeline_started = false;
+   player_head = player_done = 0;
+   player_usec = player_unit_usec = player_ticks_rem = 0;
+   player_start_usec = micros(); // (roughly, for when to stop holding)
+   while (player_behind() && build_entries(TIMELINE_CHUNK)) ;
+   hal_player_start(player_first[0], player_first[1]);
+   player_start_usec = micros();
+   step_timer.begin(player_isr, PLAYER_TICK_USEC); }
+
+void account_entries(void) { // do the bookkeeping for the entries that have been played (with interrupts off)
+   for (unsigned played = hal_player_position(); engine_running && player_done % HAL_PLAYER_SIZE != played; ++player_done) {
+      byte events = player_events[player_done % HAL_PLAYER_SIZE];
+      if (events == PLAYER_UNIT_END) {
+         unsigned long next_usec;
+         finish_unit(unit_duration_usec, &next_usec); // (which stops the player, if nothing more is queued)
+         continue; }
+      for (; events; --events) { // as in timeline_isr()
+         struct step_event_t *ev = &timeline[timeline_tail++ % TIMELINE_SIZE];
+         struct motord_t *pmd = motor_num_to_descr[ev->motor];
+         if (!pmd->moving) continue; // (it was stopped)
+         count_ustep(pmd->motor_number, ev->late_usec);
+         ++total_usteps;
+         ++unit_usteps;
+         pmd->net_usteps += pmd->clockwise ? 1 : -1;
+         if (++pmd->usteps_done >= pmd->usteps_needed) {
+            pmd->moving = false;
+            --motors_moving;
+            trace(TR_MOTOR_DONE, pmd->motor_number, pmd->usteps_done); } } } }
+
+void unplay_motor(struct motord_t *pmd) { // a motor was stopped: take its STEP pulses out of what hasn't been played
+   // (with interrupts off, after account_entries())
+   for (unsigned ndx = hal_player_position(); ndx != player_head % HAL_PLAYER_SIZE; ndx = (ndx + 1) % HAL_PLAYER_SIZE)
+      player_images[ndx][pmd->step_port] &= ~pmd->step_mask;
+   if (motors_moving == 0) { // that ends this time unit now, rather than when it was planned to end
+      unsigned long next_usec;
+      stop_player();
+      if (finish_unit(unit_duration_usec, &next_usec)) start_player(); } }
+
+void player_isr(void) { // the periodic interrupt: account for what has been played, and stay ahead of it
+   unsigned long isr_start_usec = micros();
+   account_entries();
+   if (engine_running && player_behind()) {
+      if (player_plan != plan_head) ++stats.timeline_starved; // (the foreground didn't keep up)
+      while (player_behind() && build_entries(TIMELINE_CHUNK)) ; }
+   ++stats.interrupts;
+   stats.interrupt_usec += micros() - isr_start_usec; }
+
+void start_stepping(unsigned long first_usec) { // start the step engine
+   start_player(); }
+
+void end_stepping(void) { // stop the step engine
+   step_timer.end();
+   stop_player(); }
+#endif
+
+#else // no timeline
+
+void start_stepping(unsigned long first_usec) { // start the step engine's interrupts for the first deadline
+   step_timer.begin(step_isr, max(first_usec, (unsigned long)MIN_TIMER_USEC)); }
+
+void end_stepping(void) { // stop the step engine's interrupts
+   step_timer.end(); }
+
+#define fill_timeline()
+#define account_entries()
+#endif
+
+void stop_movements(void) { // stop the step engine and forget all pending movements
+   if (engine_running) {
+      trace(TR_ABORT, 0, motors_moving);
+      positions_known = false; // (until they're reset or homed)
+      shadow_forget(); } // (what was parsed ahead wasn't all done)
+   noInterrupts();
+   end_stepping();
+   engine_running = false;
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      pmd->moving = false;
+   motors_moving = 0;
+   plan_tail = plan_head;
+   filling_plan->num_moves = 0;
+#ifdef STEP_TIMELINE
+   timeline_tail = timeline_head;
+   timeline_plan = plan_head;
+   timeline_started = false;
+#endif
+#ifdef HAL_STEP_PLAYER
+   timeline_built = timeline_head;
+   player_plan = plan_head;
+#endif
+   interrupts(); }
+
+// Aborts have to stop the motors quickly, before they step into a jam, no matter what the
+// foreground is doing. So a motor fault stops the step engine from the MOTOR_FAULT pin's
+// interrupt, and console_poll(), which check_abort() and other long-running loops call,
+// stops it as soon as a key (or, when streaming, an abort frame) arrives. Either way the
+// foreground then finds out through check_abort(), which cleans up and reports it.
+// The interrupt can't preempt a step interrupt, but those are short. The longest time
+// between looks at the console while the motors move is what "stats" reports as the
+// worst stop latency for ESC.
+
+unsigned long last_poll_usec;      // when console_poll() was last called,
+bool last_poll_moving = false;     //   and whether the motors were moving then
+
+void stop_stepping(void) { // stop the step engine's interrupts right now; check_abort() does the rest
+   noInterrupts(); // (so the step interrupt doesn't restart the timer)
+   end_stepping();
+   interrupts(); }
+
+void fault_isr(void) { // the MOTOR_FAULT line went low
+   end_stepping(); // (the step interrupt can't be running, because it has a higher priority)
+   fault_latched = true;
+   ++stats.motor_faults; }
+
+void console_poll(void) { // the background receive hook: stop the motors as soon as an abort arrives
+   unsigned long now = micros();
+   if (engine_running && last_poll_moving && now - last_poll_usec > stats.worst_poll_gap_usec)
+      stats.worst_poll_gap_usec = now - last_poll_usec;
+   last_poll_usec = now;
+   last_poll_moving = engine_running;
+   if (!engine_running) return; // (otherwise a key is the next command)
+   if (streaming ? stream_aborted() : key_waiting || (key_waiting = Serial.available() > 0)) stop_stepping(); }
+
+bool wait_for_movements(void) { // wait until everything queued has been done; return false if aborted
+   while (engine_running) {
+      drain_trace();
+      fill_timeline();
+      prefetch_cards();
+      if (check_abort()) {
+         stop_movements();
+         return false; } }
+   drain_trace();
+   return !check_lost_steps(true); }
+
+bool submit_movements(unsigned long duration_usec) { // add the movements queued for this time unit to the engine's queue
+   // return false if aborted while waiting for room in the queue
+   struct plan_t *plan = filling_plan;
+   if (plan->num_moves == 0) return true;
+   if (!dry_run) {
+      digitalWrite(MOTOR_ENB, LOW); // enable the motors...when to disable, if ever?
+      journal_moving(); }
+   trace(TR_SUBMIT, plan_head % PLAN_QUEUE_SIZE, plan->num_moves);
+   plan->duration_usec = schedule_moves(plan, duration_usec);
+   for (int ndx = 0; ndx < plan->num_moves; ++ndx) // do all required movements within one time unit
+      plan_profile(&plan->moves[ndx]);
+   noInterrupts();
+   ++plan_head;
+   if (!engine_running) { // start the step engine
+      engine_running = true;
+      ++stats.units_from_idle;
+      unit_start_usec = micros();
+      unsigned long first_usec = start_plan();
+      step_timer.priority(STEP_TIMER_PRIORITY);
+      if (digitalRead(MOTOR_FAULT) == HIGH) // (otherwise check_abort() will stop us)
+         start_stepping(first_usec); }
+   interrupts();
+   filling_plan->num_moves = 0;
+   fill_timeline();
+   while (plan_head - plan_tail >= PLAN_QUEUE_SIZE) { // wait for room to fill the next one
+      drain_trace();
+      fill_timeline();
+      prefetch_cards();
+      if (check_abort()) {
+         stop_movements();
+         return false; } }
+   return true; }
+
 bool do_movements(unsigned long duration_usec) { // do all the movements queued up for this time unit
    // return true if everything worked ok
-   if (motors_moving == 0) return true;
-#define TICK_USEC 100  // how often to check for something to do
-   digitalWrite(MOTOR_ENB, LOW); // enable the motors...when to disable, if ever?
-   if (debug >= 2) Serial.printf("  doing movements for %d motors\n", motors_moving);
-   int totalsteps = 0;
-   while (motors_moving > 0) {  // while there are pending movements
-      if (check_abort()) {
-         motors_moving = 0;
+   return submit_movements(duration_usec) && wait_for_movements(); }
+
+unsigned movement_usteps(struct motord_t *pmd, int distance) { // how many microsteps a movement takes
+   if (pmd->motor_type == ROTATE) { // distance is signed degrees
+      unsigned long gear_ratio = pmd->gear_ratio ? pmd->gear_ratio : 1000;
+      return (abs(distance) * gear_ratio * uSTEPS_PER_ROTATION) / (360 * 1000); }
+   else // LIFT; distance is signed mils
+      return (abs(distance) * uSTEPS_PER_ROTATION) / LIFT_MILS_PER_ROTATION; }
+
+unsigned take_usteps(struct motord_t *pmd, int distance) { // the microsteps for a movement that is being done
+   // Like movement_usteps(), but the fraction of a microstep that is left over is carried to
+   // the next movement of the motor, so that many movements, like the 110.77 microsteps of a
+   // giveoff by the geared rotators, don't drift away from where they should have ended up.
+   long long numerator;
+   long denominator;
+   if (pmd->motor_type == ROTATE) {
+      numerator = distance * (long long)(pmd->gear_ratio ? pmd->gear_ratio : 1000) * uSTEPS_PER_ROTATION;
+      denominator = 360 * 1000L; }
+   else {
+      numerator = distance * (long long)uSTEPS_PER_ROTATION;
+      denominator = LIFT_MILS_PER_ROTATION; }
+   numerator += pmd->ustep_fraction; // (less than one degree or mil moves, so the direction stays the same)
+   long usteps = numerator / denominator;
+   pmd->ustep_fraction = numerator - (long long)usteps * denominator;
+   return labs(usteps); }
+
+bool queue_distance(struct motord_t *pmd, int distance) { // queue a movement of a distance
+   // and carry the fraction of a microstep that is left over only if it could be queued
+   long saved_fraction = pmd->ustep_fraction;
+   if (queue_usteps(pmd, distance > 0, take_usteps(pmd, distance))) return true;
+   pmd->ustep_fraction = saved_fraction;
+   return false; }
+
+bool queue_usteps ( // queue a movement of a known number of microsteps
+   struct motord_t *pmd, bool clockwise, unsigned usteps) {
+   struct plan_t *plan = filling_plan;
+   for (int ndx = 0; ndx < plan->num_moves; ++ndx)
+      if (plan->moves[ndx].pmd == pmd) {
+         Serial.printf("axle %s is already scheduled to move\n", pmd->axle_name);
          return false; }
-      unsigned long timenow = micros();
-      for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
-         if (pmd->moving) { // look at all the motors that are moving
-            // do all required movements evenly spaced within one time unit
-            if (timenow - pmd->last_ustep_time_usec >= duration_usec / pmd->usteps_needed) {
-               digitalWrite(MOTOR_DIR, pmd->clockwise);
-               int pin = motor_step_pins[pmd->motor_number];
-               digitalWrite(pin, HIGH); // do one microstep
-               delayMicroseconds(3); // TI DRV8825 stepper motor controller spec: pulse min 1.9 usec high
-               digitalWrite(pin, LOW);
-               ++totalsteps;
-               pmd->last_ustep_time_usec = timenow;
-               if (++pmd->usteps_done >= pmd->usteps_needed) { // if this motor is done
-                  pmd->moving = false;
-                  --motors_moving; } } } }
-      delayMicroseconds(TICK_USEC); }
-   if (debug >= 2) Serial.printf("     did %d steps\n", totalsteps);
+   if (usteps > 0) { // the step engine will pick it up when the time unit is submitted
+      struct plan_move_t *move = &plan->moves[plan->num_moves++];
+      move->pmd = pmd;
+      move->clockwise = clockwise;
+      move->usteps = usteps;
+      move->duration_usec = 0;
+      move->after = NULL; }
    return true; }
 
+void time_movement ( // give a queued movement its own duration, and maybe a movement it starts after
+   struct motord_t *pmd, int percent, struct motord_t *after) {
+   if (compiling) {
+      compile_timing(pmd, percent, after);
+      return; }
+   struct plan_t *plan = filling_plan;
+   for (int ndx = 0; ndx < plan->num_moves; ++ndx) // (it isn't there if it didn't need to move)
+      if (plan->moves[ndx].pmd == pmd) {
+         plan->moves[ndx].duration_usec = percent ? timeunit_usec * percent / 100 : 0;
+         plan->moves[ndx].after = after; } }
+
 void queue_movement ( // queue an elemental movement to happen during this time unit
    struct motord_t *pmd, int distance) {
    if (pmd == NULL) {
       Serial.printf("bad call to queue_movement!\n");
       return; }
-   if (pmd->moving) {
-      Serial.printf("axle %s is already scheduled to move\n", pmd->axle_name);
+   if (compiling) {
+      compile_op(pmd, distance, NO_POSITION);
       return; }
-   pmd->moving = true;
-   ++motors_moving;
-   if (pmd->motor_type == ROTATE) { // distance is signed degrees
-      unsigned long gear_ratio = pmd->gear_ratio ? pmd->gear_ratio : 1000;
-      pmd->usteps_needed = (abs(distance) * gear_ratio * uSTEPS_PER_ROTATION) / (360 * 1000);
-      pmd->clockwise = distance > 0;
-      if (debug >= 3) Serial.printf("  queued motor %s rotator %s %d degrees by %d microsteps\n",
-                                       pmd->axle_name, pmd->clockwise ? "CW" : "CCW", abs(distance), pmd->usteps_needed); }
-   else { // LIFT; distance is signed mils
-      pmd->usteps_needed = (abs(distance) * uSTEPS_PER_ROTATION) / LIFT_MILS_PER_ROTATION;
-      pmd->clockwise = distance > 0;
-      if (debug >= 3) Serial.printf("  queued motor %s lifter %s %d mils by %d microsteps\n",
-                                       pmd->axle_name, pmd->clockwise ? "CW" : "CCW", abs(distance), pmd->usteps_needed); }
-   pmd->usteps_done = 0;
-   pmd->last_ustep_time_usec = 0; }
+   long saved_fraction = pmd->ustep_fraction;
+   unsigned usteps = take_usteps(pmd, distance);
+   if (queue_usteps(pmd, distance > 0, usteps)) {
+      trace(distance > 0 ? TR_QUEUE_CW : TR_QUEUE_CCW, pmd->motor_number, usteps);
+      shadow_rotation(pmd, distance); }
+   else pmd->ustep_fraction = saved_fraction; } // (it isn't moving after all)
+
+bool wait_to_continue(void) { // between steps of a script: wait for Enter, or return false for ESC
+   if (streaming) return true; // (the host is in charge)
+   Serial.println("waiting...");
+   while (1) {
+      int key = wait_for_char();
+      if (key == '\n') return true;
+      if (key == '\e') { // ESC
+         Serial.println("aborted...");
+         return false; } } }
+
+int skip_lines = 0; // how many lines of the script being interpreted "skipif" says to skip
 
 void do_script(const char **commands, bool pause) { // run a sequence of commands
    int cyclenum = 0;
+   skip_lines = 0;
    while (1) { // for each time unit
       if (debug >= 1) Serial.printf("*** time unit %d: %s\n", ++cyclenum, *commands);
       scan_commands(*commands);
       if (got_error) break;
-      if (!do_movements(timeunit_usec)) break;
+      if (!submit_movements(timeunit_usec)) return; // the next time unit is parsed while this one moves
+      for (; skip_lines > 0 && commands[1]; --skip_lines) {
+         if (debug >= 1) Serial.printf("*** skipped time unit %d: %s\n", ++cyclenum, *++commands);
+         else ++commands; }
+      skip_lines = 0;
       if (!*++commands) break;
-      if (pause) {
-         Serial.println("waiting...");
-         while (1) {
-            int key = wait_for_char();
-            if (key == '\n') break;
-            if (key == '\e') { // ESC
-               Serial.println("aborted...");
-               return; } } } }
+      if (pause && !(wait_for_movements() && wait_to_continue())) return; }
+   if (!wait_for_movements()) return;
    if (debug >= 1) Serial.println ("end of script"); }
 
 void do_reset(void) { // reset our internal state, but not the hardware
+   stop_movements();
    for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
-      pmd->moving = false;
-      pmd->current_position = 0; } }
+      pmd->current_position = 0;
+      pmd->ustep_fraction = 0; }
+   positions_known = true; }
+
+void do_home(void) { // move everything to the initial positions
+   positions_known = true; // (unless it's aborted)
+   run_script(&home_commands, false); }
 
 void do_test(void) { // various changeable test code...
    Serial.println("do test");
@@ -573,30 +1820,42 @@ void do_move(struct fct_move_t *move) { // queue up an elementary motion
    pmd = motor_num_to_descr[move->motor_num];
    int desired_position = move->position;
    int distance = desired_position - pmd->current_position;
-   if (distance == 0)
+   if (compiling) { // just record it, even if it's already there when compiled
+      compile_op(pmd, distance, desired_position);
+      pmd->current_position = desired_position; }
+   else if (distance == 0)
       Serial.printf("already there: %s\n", pmd->axle_name);
    else {
       queue_movement(pmd, distance);
-      pmd->current_position = desired_position; } }
+      pmd->current_position = desired_position;
+      shadow_position(pmd, desired_position); } }
 
 struct fct_move_t *do_function( // parse axle name(s) and queue up a move
-   struct fct_move_t *move, const char **pptr) {
+   struct fct_move_t *table, const char **pptr) {
    const char *savep = *pptr;
-   for (; move->keyword1; ++move) {
-      if (scan_key(pptr, move->keyword1)) {
-         if (move->keyword2) { // if there needs to be a second keyword
-            if (!scan_key(pptr, move->keyword2)) { // check if it matches
-               *pptr = savep; // if not, abort this match
-               continue; } }
-         do_move(move);
-         return move; } }
-   error("unknown axle", *pptr);
-   return NULL; }
+   struct fct_move_t *move = (struct fct_move_t *) scan_keyword(pptr, (uintptr_t)table);
+   if (move && move->keyword2) { // there needs to be a second keyword
+      // entries with the same first keyword are adjacent, and the hash finds the first one
+      char word[MAX_WORD];
+      const char *keyword1 = move->keyword1;
+      scan_word(pptr, word);
+      for (; move->keyword1 && word_is(move->keyword1, keyword1); ++move)
+         if (move->keyword2 && word_is(word, move->keyword2)) break;
+      if (!move->keyword1 || !word_is(move->keyword1, keyword1)) move = NULL; }
+   if (!move) {
+      *pptr = savep;
+      error("unknown axle", *pptr);
+      return NULL; }
+   do_move(move);
+   return move; }
+
+int interlock_errors = 0; // how many times locked() has stopped a movement
 
 bool locked (int motor_num) {
    struct motord_t *md = motor_num_to_descr[motor_num];
    if (md->current_position == 0) {
       Serial.printf("ERROR: %s is locked!\n",  md->axle_name);
+      ++interlock_errors;
       return true; }
    return false; }
 
@@ -625,26 +1884,364 @@ struct motord_t *move_to_switch(struct fct_move_t /*lifter*/ *move) {
    if (debug >= 1) Serial.printf("rotating %s 10 digits\n", rotate_axle->axle_name);
    queue_movement(rotate_axle, DEGREES_PER_DIGIT * 10); // rotate 10 digits to ensure the wheel engages with the finger
    if (!do_movements(timeunit_usec * 10)) return NULL;
-   int limit = 370;
-   while (--limit && digitalRead(switch_port) == 0) { // if it's sitting on the switch
-      if (debug >= 1) Serial.printf("getting %s off the switch\n", rotate_axle->axle_name);
-      queue_movement(rotate_axle, 1 /*degree*/); // get it off
-      if (!do_movements(timeunit_degree_usec)) return NULL; }
-   if (!limit) error("switch is always on!", "");
+   return home_to_switch(rotate_axle, switch_port) ? rotate_axle : NULL; }
+
+//****  the shadow digit wheel model
+
+// The machine can't sense what number is on its digit wheels, so we keep a model of them,
+// in the style of DigitStack and DigitWheelCarry in component.py, and update it whenever a
+// movement that turns the fingers or the carry sectors is queued. A stack is only "known"
+// once it has been zeroed or set with the "value" command, and it becomes unknown again
+// whenever something happens that we don't model, like movements being aborted midway,
+// a finger turning by part of a digit, or the motors being turned off.
+//
+// When a finger turns one digit, the wheels of the stack it is engaged with that were at
+// the finger's old position move down to its new one, as in checkfinger(). Each wheel that
+// moves turns the corresponding wheel of the stack it is meshed to, if any, up by one, and
+// an F wheel that goes from 9 to 0 that way warns for a carry. "carry add" then adds the
+// carries, including those that run through a chain of 9s, as compute_carriage() does, and
+// sets the "running up" condition if there is a carry out of the top digit.
+//
+// Because the model is updated when the commands are parsed, it describes the machine as
+// it will be once everything queued so far is done, which is where "skipif" needs it.
+// Subtraction and shifting by the movable long pinions aren't modeled yet.
+
+#define NUM_DIGITS 4                 // digit wheels in each stack of the first prototype
+#define UNKNOWN_DIGIT -1
+
+enum stack_num_t {STACK_F, STACK_A1, STACK_A2, NUM_STACKS };
+const int stack_locks[NUM_STACKS] = {FK_R, A1K_R, A2K_R };
+
+struct digit_stack_t { // what we think is on one stack of digit wheels
+   const char *name;
+   bool known;                       // do we know what the digits are?
+   byte digits[NUM_DIGITS];          // if so, the digit on each wheel, least significant first
+   bool warned[NUM_DIGITS]; };       // and which wheels have warned for a carry (only F has the arms)
+struct shadow_t {
+   struct digit_stack_t stacks[NUM_STACKS];
+   int f_finger, a_finger; }         // which digit position the F and A fingers are at, or UNKNOWN_DIGIT
+shadow = {{{"F"}, {"A1"}, {"A2"}}, UNKNOWN_DIGIT, UNKNOWN_DIGIT };
+bool running_up = false;             // was there a carry out of the top digit of F in the last carriage?
+
+enum skip_condition_t {SKIP_ZERO, SKIP_NONZERO, SKIP_CARRY, SKIP_NOCARRY };
+#define SKIP_UNLESS 0x10             // added to the condition for "skipunless"
+const char *skip_conditions[] = {"zero", "nonzero", "carry", "nocarry", NULL };
+
+void shadow_forget(void) { // we no longer know anything
+   for (int stack = 0; stack < NUM_STACKS; ++stack)
+      shadow.stacks[stack].known = false;
+   shadow.f_finger = shadow.a_finger = UNKNOWN_DIGIT; }
+
+void shadow_zero(int stack) { // the stack was just zeroed, which leaves its finger one digit past zero
+   struct digit_stack_t *sp = &shadow.stacks[stack];
+   sp->known = true;
+   memset(sp->digits, 0, sizeof(sp->digits));
+   memset(sp->warned, 0, sizeof(sp->warned));
+   if (stack == STACK_F) shadow.f_finger = 9;
+   else shadow.a_finger = 9; }
+
+int engaged_stack(int rotator) { // which stack the finger of a rotator is engaged with, or -1
+   int lift = motor_num_to_descr[rotator == F_R ? F_L : A_L]->current_position;
+   if (lift == 0) return -1;
+   return rotator == F_R ? STACK_F : lift > 0 ? STACK_A1 : STACK_A2; }
+
+int meshed_stack(int stack) { // which stack the long pinions connect a stack to, or -1
+   if (motor_num_to_descr[FC_L]->current_position == 0) return -1;
+   int fpc = motor_num_to_descr[FPC_L]->current_position, mpc = motor_num_to_descr[MPC_L]->current_position;
+   if (stack == STACK_F) {
+      int connector = fpc ? fpc : mpc;
+      return connector > 0 ? STACK_A1 : connector < 0 ? STACK_A2 : -1; }
+   if ((stack == STACK_A1 && (fpc > 0 || mpc > 0)) || (stack == STACK_A2 && (fpc < 0 || mpc < 0)))
+      return STACK_F;
+   return -1; }
+
+void shadow_drive(int stack, int digit) { // a meshed wheel turns up by one
+   struct digit_stack_t *sp = &shadow.stacks[stack];
+   if (!sp->known) return;
+   if (motor_num_to_descr[stack_locks[stack]]->current_position == 0) {
+      Serial.printf("** warning: %s is locked but is being turned\n", sp->name);
+      sp->known = false;
+      return; }
+   sp->digits[digit] = (sp->digits[digit] + 1) % 10;
+   if (stack == STACK_F && sp->digits[digit] == 0) sp->warned[digit] = true; }
+
+void shadow_forget_finger(struct motord_t *pmd) { // a rotator moved in some way we don't model
+   if (pmd->motor_number != F_R && pmd->motor_number != A_R) return;
+   int stack = engaged_stack(pmd->motor_number);
+   if (stack >= 0) {
+      shadow.stacks[stack].known = false;
+      int target = meshed_stack(stack);
+      if (target >= 0) shadow.stacks[target].known = false; }
+   if (pmd->motor_number == F_R) shadow.f_finger = UNKNOWN_DIGIT;
+   else shadow.a_finger = UNKNOWN_DIGIT; }
+
+void shadow_giveoff(struct motord_t *pmd) { // a rotator's finger turned down one digit
+   int *finger = pmd->motor_number == F_R ? &shadow.f_finger : &shadow.a_finger;
+   if (*finger == UNKNOWN_DIGIT) {
+      shadow_forget_finger(pmd);
+      return; }
+   int from = *finger, to = (from + 9) % 10;
+   *finger = to;
+   int stack = engaged_stack(pmd->motor_number);
+   if (stack < 0) return;
+   struct digit_stack_t *sp = &shadow.stacks[stack];
+   int target = meshed_stack(stack);
+   if (target >= 0 && motor_num_to_descr[MP_L]->current_position != 0) { // a shift, which we don't model
+      shadow.stacks[target].known = false;
+      target = -1; }
+   if (!sp->known) {
+      if (target >= 0) shadow.stacks[target].known = false;
+      return; }
+   for (int digit = 0; digit < NUM_DIGITS; ++digit)
+      if (sp->digits[digit] == from) {
+         sp->digits[digit] = to;
+         if (target >= 0) shadow_drive(target, digit); } }
+
+void shadow_rotation(struct motord_t *pmd, int distance) { // a relative movement was queued
+   if (pmd->motor_number != F_R && pmd->motor_number != A_R) return;
+   if (distance % DEGREES_PER_DIGIT != 0 || distance < 0) { // between digits, or backwards
+      shadow_forget_finger(pmd);
+      return; }
+   for (int digits = distance / DEGREES_PER_DIGIT; digits > 0; --digits)
+      shadow_giveoff(pmd); }
+
+void shadow_carriage(void) { // the carry sectors add 1 above each warned wheel of F
+   struct digit_stack_t *sp = &shadow.stacks[STACK_F];
+   running_up = false;
+   if (!sp->known) return;
+   bool carry = false;
+   for (int digit = 0; digit < NUM_DIGITS; ++digit) { // the anticipated carries ripple up through 9s
+      bool carry_out = sp->warned[digit] || (carry && sp->digits[digit] == 9);
+      if (carry) sp->digits[digit] = (sp->digits[digit] + 1) % 10;
+      sp->warned[digit] = false;
+      carry = carry_out; }
+   running_up = carry; }
+
+void shadow_position(struct motord_t *pmd, int position) { // a functional movement was queued
+   if (pmd->motor_number != W_R) return;
+   if (position == CARRY_ADD_POSITION) shadow_carriage();
+   else if (position == CARRY_SUB_POSITION) shadow.stacks[STACK_F].known = false; }
+
+bool skip_condition(int condition, int stack) { // is it known that the condition is true?
+   if (condition & SKIP_UNLESS) return !skip_condition(condition & ~SKIP_UNLESS, stack);
+   struct digit_stack_t *sp = &shadow.stacks[stack];
+   if (!sp->known) return false;
+   bool zero = true, warned = false;
+   for (int digit = 0; digit < NUM_DIGITS; ++digit) {
+      zero &= sp->digits[digit] == 0;
+      warned |= sp->warned[digit]; }
+   switch (condition) {
+      case SKIP_ZERO: return zero;
+      case SKIP_NONZERO: return !zero;
+      case SKIP_CARRY: return warned;
+      case SKIP_NOCARRY: return !warned; }
+   return false; }
+
+int scan_stack(const char **pptr) { // scan F, A1, or A2, and return the stack number or -1
+   char word[MAX_WORD];
+   const char *savep = *pptr;
+   scan_word(pptr, word);
+   for (int stack = 0; stack < NUM_STACKS; ++stack)
+      if (word_is(word, shadow.stacks[stack].name)) return stack;
+   *pptr = savep;
+   return -1; }
+
+void shadow_show(int stack) {
+   struct digit_stack_t *sp = &shadow.stacks[stack];
+   Serial.printf("%-2s = ", sp->name);
+   if (!sp->known) Serial.print("unknown");
    else {
-      limit = 370;
-      if (debug >= 1) Serial.printf("rotating %s to the switch position\n", rotate_axle->axle_name);
-      while (--limit && digitalRead(switch_port) == 1) { // now rotate until it just gets on the switch
-         // don't need to find the center point, since we always approach it the same way
-         queue_movement(rotate_axle, 1 /*degree*/);
-         if (!do_movements(timeunit_degree_usec)) return NULL; }
-      if (!limit) {
-         error ("switch is always off!", "");
-         return NULL; } }
-   return rotate_axle; }
+      for (int digit = NUM_DIGITS - 1; digit >= 0; --digit)
+         Serial.printf("%d", sp->digits[digit]);
+      for (int digit = 0; digit < NUM_DIGITS; ++digit)
+         if (sp->warned[digit]) Serial.printf(", carry warned on digit %d", digit); }
+   Serial.println(); }
+
+void do_value(const char **pptr) { // value [F | A1 | A2] [<number> | unknown]
+   int stack = scan_stack(pptr);
+   if (stack < 0) {
+      if (**pptr && **pptr != ';') error("bad digit wheels", *pptr);
+      else {
+         for (stack = 0; stack < NUM_STACKS; ++stack)
+            shadow_show(stack);
+         if (shadow.f_finger != UNKNOWN_DIGIT) Serial.printf("F finger at %d\n", shadow.f_finger);
+         if (shadow.a_finger != UNKNOWN_DIGIT) Serial.printf("A finger at %d\n", shadow.a_finger);
+         Serial.printf("running up: %s\n", running_up ? "yes" : "no"); }
+      return; }
+   struct digit_stack_t *sp = &shadow.stacks[stack];
+   int number;
+   if (scan_key(pptr, "unknown")) sp->known = false;
+   else if (scan_int(pptr, &number, 0, 9999)) {
+      sp->known = true;
+      for (int digit = 0; digit < NUM_DIGITS; ++digit, number /= 10) {
+         sp->digits[digit] = number % 10;
+         sp->warned[digit] = false; } }
+   else if (**pptr && **pptr != ';') error("bad value", *pptr);
+   shadow_show(stack); }
+
+void do_skipif(const char **pptr, bool unless) { // {skipif | skipunless} {zero | nonzero | carry | nocarry} {F | A1 | A2} [<lines>]
+   char word[MAX_WORD];
+   const char *savep = *pptr;
+   int condition, stack, lines = SKIP_REST;
+   scan_word(pptr, word);
+   for (condition = 0; skip_conditions[condition] && !word_is(word, skip_conditions[condition]); ++condition) ;
+   if (!skip_conditions[condition]) {
+      error("bad skip condition", savep);
+      return; }
+   if ((stack = scan_stack(pptr)) < 0) {
+      error("bad digit wheels", *pptr);
+      return; }
+   if (**pptr && **pptr != ';' && !scan_int(pptr, &lines, 1, 100)) {
+      error("bad number of lines", *pptr);
+      return; }
+   if (unless) condition |= SKIP_UNLESS;
+   if (compiling) compile_skip(condition, stack, lines); // (it's tested when the script is run)
+   else if (skip_condition(condition, stack)) {
+      if (debug >= 1) Serial.printf("%s is %s%s, so skipping %s\n", shadow.stacks[stack].name, unless ? "not known to be " : "",
+                                       word, lines == SKIP_REST ? "the rest" : "lines");
+      skip_lines = lines; } }
+
+//****  homing to the index switches
+
+// The F and A rotators find their index switches with continuous movements rather than
+// a degree at a time: a fast approach until the switch interrupt happens, a short
+// backoff, and then a slow creep until it happens again. The switch interrupt comes right
+// after the STEP pulse that closed the switch, and the step interrupt has a higher priority
+// but can't do another step of the motor in between at these speeds, so the interrupt
+// routine stops the motor right at the switch. We always approach the switch clockwise,
+// so we don't need to find its center point.
+
+#define HOMING_FAST_USTEPS_PER_SEC 2000  // about 200 degrees/sec of the digit wheels
+#define HOMING_SLOW_USTEPS_PER_SEC 200   // about 20 degrees/sec
+#define HOMING_BACKOFF_DEGREES 10        // how far to back off before the slow creep
+
+struct motord_t *volatile homing_axle = NULL; // the rotator looking for its switch
+volatile bool home_latched;                   // has its switch interrupt happened?
+
+void index_isr(void) { // the index switch changed the way we were waiting for
+   struct motord_t *pmd = homing_axle;
+   if (!pmd || home_latched) return;
+   noInterrupts(); // (the step timer has a higher priority)
+   home_latched = true;
+   stop_motor(pmd);
+   interrupts(); }
+
+bool rotate_at(struct motord_t *pmd, int degrees, unsigned long usteps_per_sec) { // rotate at about this speed
+   // return false if aborted
+   unsigned usteps = movement_usteps(pmd, degrees);
+   queue_usteps(pmd, degrees > 0, usteps);
+   unsigned long duration_usec = usteps * 1000000ULL / usteps_per_sec;
+   return do_movements(max(duration_usec, min_move_usec(pmd, usteps) + 1)); } // (within the motor's limits)
+
+bool rotate_until(struct motord_t *pmd, int switch_pin, int edge, int max_degrees, unsigned long usteps_per_sec) {
+   // rotate clockwise until the switch makes the edge, stop there, and return true
+   home_latched = false;
+   homing_axle = pmd;
+   attachInterrupt(digitalPinToInterrupt(switch_pin), index_isr, edge);
+   bool ok = rotate_at(pmd, max_degrees, usteps_per_sec);
+   detachInterrupt(digitalPinToInterrupt(switch_pin));
+   homing_axle = NULL;
+   watch_index_switches(); // (which detaching stopped)
+   if (!ok) return false;
+   if (!home_latched) {
+      error(edge == FALLING ? "switch is always off!" : "switch is always on!", "");
+      return false; }
+   return true; }
+
+bool home_to_switch(struct motord_t *pmd, int switch_pin) { // leave a rotator just where its index switch closes
+   if (digitalRead(switch_pin) == 0) { // if it's sitting on the switch
+      if (debug >= 1) Serial.printf("getting %s off the switch\n", pmd->axle_name);
+      if (!rotate_until(pmd, switch_pin, RISING, 370, HOMING_FAST_USTEPS_PER_SEC)) return false; }
+   if (debug >= 1) Serial.printf("rotating %s to the switch position\n", pmd->axle_name);
+   if (!rotate_until(pmd, switch_pin, FALLING, 370, HOMING_FAST_USTEPS_PER_SEC)) return false; // the fast approach
+   if (!rotate_at(pmd, -HOMING_BACKOFF_DEGREES, HOMING_FAST_USTEPS_PER_SEC)) return false;
+   if (digitalRead(switch_pin) == 0) {
+      error("switch is always on!", "");
+      return false; }
+   if (!rotate_until(pmd, switch_pin, FALLING, 2 * HOMING_BACKOFF_DEGREES, HOMING_SLOW_USTEPS_PER_SEC)) return false; // the slow creep
+   pmd->net_usteps = pmd->index_usteps = 0; // this is now the reference point for finding lost steps
+   pmd->ustep_fraction = 0; //   and for the fractions of microsteps
+   pmd->lost_usteps = pmd->correction_usteps = 0;
+   pmd->index_referenced = true;
+   return true; }
+
+//****  lost step detection at the index switches
+
+// After a rotator has been homed, we know exactly how many microsteps from its index
+// switch it should be, so whenever the switch closes while the rotator is turning
+// clockwise (the direction homing approached it from) it should be at a whole number of
+// digit wheel revolutions. If it isn't, by more than a little, then steps were lost.
+// The count is then corrected to where the rotator really is, and the difference is
+// either made up by moving it when the movements are next finished, or the movements are
+// aborted. Counter-clockwise passes aren't checked, because the switch closes somewhere
+// else then, depending on how wide it is.
+
+#define LOST_STEP_TOLERANCE 6   // microsteps of slop allowed, about 0.6 degrees of the digit wheels
+enum lostcheck_t {LOSTCHECK_OFF, LOSTCHECK_CORRECT, LOSTCHECK_STOP };
+int lost_check = LOSTCHECK_CORRECT;
+volatile bool lost_steps_found = false; // does some rotator have lost_usteps to report?
+
+void check_index(struct motord_t *pmd) { // its index switch just closed: is the rotator where we think?
+   if (!pmd->index_referenced || !pmd->clockwise) return;
+   float rev_usteps = pmd->gear_ratio * (float)uSTEPS_PER_ROTATION / 1000; // per revolution of the digit wheels
+   noInterrupts(); // (the step timer has a higher priority)
+   account_entries(); // (with the step timeline player, for the microsteps it has done by now)
+   long net = pmd->net_usteps;
+   if (labs(net - pmd->index_usteps) > rev_usteps / 2) { // (otherwise it's switch bounce, or the same pass again)
+      long expected = lroundf(lroundf(net / rev_usteps) * rev_usteps);
+      int offset = net - expected;
+      pmd->net_usteps -= offset; // where it really is
+      pmd->index_usteps = expected;
+      ++stats.index_checks;
+      if (abs(offset) > LOST_STEP_TOLERANCE) {
+         pmd->lost_usteps += offset;
+         lost_steps_found = true;
+         ++stats.lost_step_faults; } }
+   interrupts(); }
+
+void f_index_isr(void) {
+   check_index(motor_num_to_descr[F_R]); }
+
+void a_index_isr(void) {
+   check_index(motor_num_to_descr[A_R]); }
+
+void watch_index_switches(void) { // (re)start watching for the index switches to close
+   if (lost_check == LOSTCHECK_OFF) return;
+   attachInterrupt(digitalPinToInterrupt(F_ROTATE_INDEX), f_index_isr, FALLING);
+   attachInterrupt(digitalPinToInterrupt(A_ROTATE_INDEX), a_index_isr, FALLING); }
+
+bool check_lost_steps(bool idle) { // report lost steps, and return true if the movements should be aborted
+   if (lost_steps_found) {
+      lost_steps_found = false;
+      for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+         if (pmd->lost_usteps) {
+            noInterrupts();
+            int lost = pmd->lost_usteps;
+            pmd->lost_usteps = 0;
+            interrupts();
+            Serial.printf("** lost steps: axle %s was %d microsteps %s at its index switch\n",
+                          pmd->axle_name, abs(lost), lost > 0 ? "behind" : "ahead");
+            pmd->correction_usteps += lost; }
+      if (lost_check == LOSTCHECK_STOP) {
+         for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+            pmd->correction_usteps = 0; // (everything will have to be homed anyway)
+         Serial.printf("** stopping; try a longer time unit\n");
+         return true; } }
+   if (idle && !engine_running) { // make up any lost steps now
+      unsigned long duration_usec = 0;
+      for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+         if (pmd->correction_usteps) {
+            unsigned usteps = abs(pmd->correction_usteps);
+            if (debug >= 1) Serial.printf("correcting %s by %d microsteps\n", pmd->axle_name, pmd->correction_usteps);
+            queue_usteps(pmd, pmd->correction_usteps > 0, usteps);
+            pmd->correction_usteps = 0;
+            duration_usec = max(duration_usec, max(usteps * 1000000UL / HOMING_SLOW_USTEPS_PER_SEC, min_move_usec(pmd, usteps) + 1)); }
+      if (duration_usec && !do_movements(duration_usec)) return true; }
+   return false; }
 
 void do_zero_reset (    // cleanup after "calibrate" or "zero" commands
    struct motord_t *rotate_axle, struct fct_move_t *lift_move) {
+   int stack = rotate_axle->motor_number == F_R ? STACK_F : lift_move->position > 0 ? STACK_A1 : STACK_A2;
    if (rotate_axle->motor_number == F_R) {
       scan_commands("unmesh FC"); // unmesh the long pinions to remove drag
       scan_commands("nofinger F; lock F"); } // disengage the finger and lock
@@ -654,7 +2251,7 @@ void do_zero_reset (    // cleanup after "calibrate" or "zero" commands
    if (do_movements(timeunit_usec)) { // do finger disengagement and locking
       if (debug >= 1) Serial.printf("rotating %s past the nib\n", rotate_axle->axle_name);
       queue_movement(rotate_axle, DEGREES_PER_DIGIT); // rotate one digit past the nib
-      do_movements(timeunit_usec); } }
+      if (do_movements(timeunit_usec)) shadow_zero(stack); } }
 
 void do_zero(const char **pptr) { // zero F or A1 or A2
    struct motord_t *rotate_axle;
@@ -666,7 +2263,7 @@ void do_zero(const char **pptr) { // zero F or A1 or A2
          if (debug >= 1) Serial.printf("rotating %s %d degrees to zero\n",
                                           rotate_axle->axle_name, rotate_axle->finger_zero_degrees);
          queue_movement(rotate_axle, rotate_axle->finger_zero_degrees); // now make the final adjustment to zero
-         if (do_movements(timeunit_degree_usec * rotate_axle->finger_zero_degrees))
+         if (do_movements(timeunit_degree_usec * abs(rotate_axle->finger_zero_degrees)))
             do_zero_reset(rotate_axle, lift_move); } } }
 
 void do_calibrate(const char **pptr) { // record how many degrees past the switch point is zero
@@ -701,16 +2298,19 @@ void do_calibrate(const char **pptr) { // record how many degrees past the switc
 
 void do_giveoff(const char **pptr) { // give off one digit
    struct motord_t *axle, *finger;
-   if (scan_key(pptr, "F")) {
+   const char *savep = *pptr;
+   char word[MAX_WORD];
+   scan_word(pptr, word);
+   if (word_is(word, "F")) {
       if (locked(FK_R)) return;
       axle = motor_num_to_descr[F_R];
       finger = motor_num_to_descr[F_L];
       goto domove; }
-   else if (scan_key(pptr, "A")) {
+   else if (word_is(word, "A")) {
       axle = motor_num_to_descr[A_R];
       finger = motor_num_to_descr[A_L]; }
    else {
-      error("bad axle", *pptr);
+      error("bad axle", savep);
       return; }
    if ((finger->current_position > 0 && locked(A1K_R))
          || (finger->current_position < 0 && locked(A2K_R)))  return;
@@ -718,70 +2318,1922 @@ domove:
    if (finger->current_position == 0) Serial.printf("** warning: finger for %s not engaged\n", finger->axle_name);
    queue_movement(axle, DEGREES_PER_DIGIT); }
 
+//***** compiled scripts
+
+// At startup each script is compiled into a table of micro-ops by running its commands
+// through the normal command parser against the neutral machine state, with the movement
+// routines recording what they would queue instead of queueing it. Interlock errors
+// such as locked() are reported then. Running a compiled script just replays the ops,
+// so almost nothing happens between time units. Scripts that use commands other than
+// movements (zero, calibrate, timeunit, etc.) aren't compiled, and are interpreted.
+//
+// With "optimize on" a peephole pass then merges consecutive time units that each move
+// only the same axle by the same relative distance, like the nine "giveoff A" lines,
+// into one continuous movement. No other axle moves in between, so the interlock checks
+// done for each of the original lines still hold for the merged one. The merged unit
+// takes the time the separate ones would at the same peak speed and acceleration, but
+// without stopping in between, which is the time of one ramp less for each line merged.
+// For a motor without an acceleration limit each line is at a constant speed, so the
+// merged unit takes just as long as the lines did, and only the gaps between them go.
+
+struct script_op_t script_ops[MAX_SCRIPT_OPS];
+int num_script_ops = 0;
+int unit_first_op;           // the first op of the time unit being compiled
+bool compile_ok;             // is the script being compiled still compilable?
+bool optimize_scripts = false; // should we merge time units of compiled scripts?
+
+void compile_op(struct motord_t *pmd, int distance, int position) { // record one movement
+   for (int ndx = unit_first_op; ndx < num_script_ops; ++ndx)
+      if (script_ops[ndx].motor_num == pmd->motor_number) {
+         Serial.printf("axle %s is already scheduled to move\n", pmd->axle_name);
+         return; }
+   if (num_script_ops >= MAX_SCRIPT_OPS - 1) { // leave room for END_OF_UNIT
+      error("too many script ops", "");
+      return; }
+   struct script_op_t *op = &script_ops[num_script_ops++];
+   op->motor_num = pmd->motor_number;
+   op->position = position;
+   op->distance = distance;
+   op->usteps = movement_usteps(pmd, distance);
+   op->percent = 0;
+   op->after = -1; }
+
+void compile_timing(struct motord_t *pmd, int percent, struct motord_t *after) { // record the timing of a movement
+   for (int ndx = unit_first_op; ndx < num_script_ops; ++ndx)
+      if (script_ops[ndx].motor_num == pmd->motor_number) {
+         script_ops[ndx].percent = percent;
+         script_ops[ndx].after = after ? after->motor_number : -1; } }
+
+void compile_skip(int condition, int stack, int lines) { // record a "skipif"
+   if (num_script_ops >= MAX_SCRIPT_OPS - 1) {
+      error("too many script ops", "");
+      return; }
+   struct script_op_t *op = &script_ops[num_script_ops++];
+   op->motor_num = SKIP_OP;
+   op->position = condition;
+   op->distance = stack;
+   op->usteps = lines;
+   op->percent = 0;
+   op->after = -1; }
+
+void not_compilable(void) { // the command being scanned can't be compiled
+   compile_ok = false;
+   got_error = true; } // stop scanning the line
+
+bool compile_script(struct script_t *sp) { // compile one script, and return true if it worked
+   int saved_positions[NUM_MOTORS];
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      saved_positions[pmd->motor_number] = pmd->current_position;
+   set_neutral_positions();
+   int first_op = num_script_ops;
+   compiling = compile_ok = true;
+   for (const char **cmd = sp->commands; *cmd && compile_ok; ++cmd) {
+      unit_first_op = num_script_ops;
+      scan_commands(*cmd);
+      if (got_error) {
+         if (compile_ok) Serial.printf("  in time unit %d of script \"%s\"\n", (int)(cmd - sp->commands) + 1, sp->name);
+         compile_ok = false; }
+      else {
+         script_ops[num_script_ops].motor_num = END_OF_UNIT;
+         script_ops[num_script_ops++].lines = 1; } }
+   compiling = got_error = false;
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      pmd->current_position = saved_positions[pmd->motor_number];
+   if (!compile_ok) { // discard what we did, and interpret it instead
+      num_script_ops = first_op;
+      sp->ops = NULL;
+      return false; }
+   sp->ops = &script_ops[first_op];
+   if (optimize_scripts) optimize_script(first_op);
+   return true; }
+
+bool single_relative_unit(struct script_op_t *op) { // does this time unit just do one relative movement?
+   return op[0].motor_num != END_OF_UNIT && op[0].position == NO_POSITION && op[0].percent == 0
+          && op[1].motor_num == END_OF_UNIT; }
+
+void optimize_script(int first_op) { // merge runs of identical single relative movements in a compiled script
+   bool skip_target[MAX_SCRIPT_OPS] = {false }; // the lines a "skipif" goes to, which must start a time unit
+   for (int ndx = first_op, line = 0; ndx < num_script_ops; ++ndx) {
+      if (script_ops[ndx].motor_num == SKIP_OP && line + 1 + script_ops[ndx].usteps < MAX_SCRIPT_OPS)
+         skip_target[line + 1 + script_ops[ndx].usteps] = true;
+      if (script_ops[ndx].motor_num == END_OF_UNIT) ++line; }
+   int in = first_op, out = first_op, last_single = -1; // last_single is the output unit we might merge into
+   for (int line = 0; in < num_script_ops; ++line) { // for each time unit
+      if (single_relative_unit(&script_ops[in])) {
+         if (last_single >= 0 && !skip_target[line]
+               && script_ops[last_single].motor_num == script_ops[in].motor_num
+               && script_ops[last_single].distance / script_ops[last_single + 1].lines == script_ops[in].distance) {
+            script_ops[last_single].distance += script_ops[in].distance; // merge it
+            script_ops[last_single].usteps += script_ops[in].usteps;
+            ++script_ops[last_single + 1].lines;
+            in += 2;
+            continue; }
+         last_single = out; }
+      else last_single = -1;
+      do script_ops[out++] = script_ops[in];
+      while (script_ops[in++].motor_num != END_OF_UNIT); }
+   if (debug >= 1 && out < num_script_ops) Serial.printf("optimizer removed %d ops\n", num_script_ops - out);
+   num_script_ops = out; }
+
+unsigned long unit_duration(struct script_op_t *op) { // how long a compiled time unit should take
+   struct script_op_t *end = op;
+   while (end->motor_num != END_OF_UNIT) ++end;
+   if (end->lines == 1) return timeunit_usec;
+   // a merged movement: n lines, less the acceleration ramp for the single line's movement each time it would have stopped
+   struct motord_t *pmd = motor_num_to_descr[op->motor_num];
+   if (!pmd->accel) return end->lines * timeunit_usec; // (each line is at a constant speed, so there's no ramp to save)
+   unsigned long ramp_usec = timeunit_usec / 2; // (for a triangular profile)
+   float T = timeunit_usec, n = op->usteps / end->lines, a = pmd->accel * 1e-12f;
+   if (T * T > 4 * n / a) ramp_usec = (T - sqrtf(T * T - 4 * n / a)) / 2; // as in plan_profile()
+   return end->lines * timeunit_usec - (end->lines - 1) * ramp_usec; }
+
+void compile_scripts(void) { // compile all the predefined scripts
+   int compiled = 0, total = 1;
+   num_script_ops = 0;
+   if (compile_script(&home_commands)) ++compiled;
+   for (struct script_t *sp = named_scripts; sp->name; ++sp, ++total) {
+      if (compile_script(sp)) ++compiled;
+      else if (debug >= 1) Serial.printf("script %s will be interpreted\n", sp->name); }
+   Serial.printf("%d of %d scripts compiled into %d ops\n", compiled, total, num_script_ops);
+   library_flush(); } // (they're compiled again when they're next used)
+
+void queue_op(struct script_op_t *op) { // queue one compiled movement
+   struct motord_t *pmd = motor_num_to_descr[op->motor_num];
+   if (op->position == NO_POSITION) { // a relative movement
+      if (queue_distance(pmd, op->distance)) shadow_rotation(pmd, op->distance); }
+   else { // a functional movement to a position
+      int distance = op->position - pmd->current_position;
+      if (distance == 0)
+         Serial.printf("already there: %s\n", pmd->axle_name);
+      else if (queue_distance(pmd, distance)) {
+         pmd->current_position = op->position;
+         shadow_position(pmd, op->position); } }
+   if (op->percent || op->after >= 0)
+      time_movement(pmd, op->percent, op->after >= 0 ? motor_num_to_descr[op->after] : NULL); }
+
+int op_lines(struct script_op_t *op) { // how many script lines the time unit starting here does
+   while (op->motor_num != END_OF_UNIT) ++op;
+   return op->lines; }
+
+bool run_compiled_script(struct script_t *sp, bool pause) { // run a sequence of compiled ops
+   // return false if aborted
+   int cyclenum = 0;
+   const char **commands = sp->commands;
+   struct script_op_t *op = sp->ops;
+   while (1) { // for each time unit
+      if (debug >= 1) {
+         if (op_lines(op) == 1) Serial.printf("*** time unit %d: %s\n", ++cyclenum, *commands);
+         else Serial.printf("*** time units %d-%d: %s (merged)\n", cyclenum + 1, cyclenum + op_lines(op), *commands);
+         if (op_lines(op) > 1) cyclenum += op_lines(op); }
+      unsigned long duration_usec = unit_duration(op);
+      int skip = 0;
+      commands += op_lines(op);
+      for (; op->motor_num != END_OF_UNIT; ++op) {
+         if (op->motor_num != SKIP_OP) queue_op(op);
+         else if (skip_condition(op->position, op->distance)) skip = op->usteps; }
+      ++op;
+      if (!submit_movements(duration_usec)) return false;
+      while (skip > 0 && *commands) { // skip whole time units, which a skip never lands in the middle of
+         int lines = op_lines(op);
+         if (debug >= 1) Serial.printf("*** skipped time unit%s %d: %s\n", lines > 1 ? "s" : "", cyclenum += lines, *commands);
+         commands += lines;
+         skip -= lines;
+         while (op->motor_num != END_OF_UNIT) ++op;
+         ++op; }
+      if (!*commands) break;
+      if (pause && !(wait_for_movements() && wait_to_continue())) return false; }
+   if (!wait_for_movements()) return false;
+   if (debug >= 1) Serial.println ("end of script");
+   return true; }
+
+//****  the SD card script library
+
+// Besides the predefined scripts, "run" and "step" can use scripts from the SD card, in
+// files named /scripts/<name>.txt with one time unit per line. Blank lines, and comments
+// that start with //, are ignored. The card isn't looked at until a script that isn't
+// predefined is asked for, so the size of the library doesn't affect the startup time.
+//
+// A script from the card is read and compiled the first time it is used, and kept in
+// one of a few cache slots; when they are all full, the one that was used least recently
+// is reused. A script that is too big for a slot is instead read from the card a line at
+// a time while it runs, and interpreted. "library flush" forgets the cached scripts, for
+// when the card has been changed.
+
+#define LIBRARY_DIR "/scripts/"
+#define LIBRARY_SLOTS 4              // how many scripts from the card are cached
+#define LIBRARY_LINES 64             // the most lines a cached script can have,
+#define LIBRARY_TEXT 2048            //   the most characters,
+#define LIBRARY_OPS 160              //   and the most compiled ops
+
+struct library_slot_t {
+   char name[MAX_WORD];
+   unsigned long last_used;          // when it was last asked for, in library_uses; 0 if the slot is empty
+   int running;                      // how many runs of it are in progress, so it isn't reused
+   struct script_t script;           // the script, which points to these:
+   const char *commands[LIBRARY_LINES + 1];
+   char text[LIBRARY_TEXT];
+   struct script_op_t ops[LIBRARY_OPS];
+} library[LIBRARY_SLOTS];
+unsigned long library_uses = 0;
+int sd_card = 0;                     // 1 if there is an SD card, -1 if not, 0 if we haven't looked yet
+char library_stream_name[MAX_WORD];
+struct script_t library_stream = {library_stream_name }; // for scripts that are too big: no commands
+
+void library_flush(void) {
+   for (int slot = 0; slot < LIBRARY_SLOTS; ++slot)
+      if (!library[slot].running) library[slot].last_used = 0; }
+
+void library_show(void) {
+   if (sd_card == 0) Serial.println("the SD card hasn't been looked at yet");
+   else if (sd_card < 0) Serial.println("there is no SD card");
+   for (int slot = 0; slot < LIBRARY_SLOTS; ++slot)
+      if (library[slot].last_used) {
+         int lines = 0;
+         while (library[slot].commands[lines]) ++lines;
+         Serial.printf("  %-16s %3d lines, %s\n", library[slot].name, lines,
+                       library[slot].script.ops ? "compiled" : "interpreted"); } }
+
+int library_open(const char *name) { // open a script file, or return -1
+   char path[sizeof(LIBRARY_DIR) + MAX_WORD + 4];
+   if (sd_card == 0) sd_card = hal_sd_begin() ? 1 : -1;
+   if (sd_card < 0) return -1;
+   snprintf(path, sizeof(path), LIBRARY_DIR "%s.txt", name);
+   return hal_sd_open(path); }
+
+bool library_gets(int file, char *line) { // read the next line that isn't blank or a comment
+   while (hal_sd_gets(file, line, CMDLENGTH)) {
+      console_poll(); // (this can be slow, and the motors may be moving)
+      char *comment = strstr(line, "//");
+      if (comment) *comment = 0;
+      int len = strlen(line);
+      while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) line[--len] = 0;
+      const char *ptr = line;
+      skip_blanks(&ptr);
+      if (*ptr) return true; }
+   return false; }
+
+bool library_load(struct library_slot_t *slot, int file) { // read a script into a slot; false if it's too big
+   char line[CMDLENGTH];
+   int lines = 0, used = 0;
+   while (library_gets(file, line)) {
+      int len = strlen(line) + 1;
+      if (lines >= LIBRARY_LINES || used + len > LIBRARY_TEXT) return false;
+      strcpy(slot->text + used, line);
+      slot->commands[lines++] = slot->text + used;
+      used += len; }
+   slot->commands[lines] = NULL;
+   return lines > 0; }
+
+struct script_t *library_script(const char *name) { // find a script on the SD card, or return NULL
+   struct library_slot_t *slot = NULL;
+   for (int ndx = 0; ndx < LIBRARY_SLOTS; ++ndx)
+      if (library[ndx].last_used && word_is(library[ndx].name, name)) {
+         library[ndx].last_used = ++library_uses;
+         return &library[ndx].script; }
+   int file = library_open(name);
+   if (file < 0) return NULL;
+   for (int ndx = 0; ndx < LIBRARY_SLOTS; ++ndx) // the least recently used slot we can reuse
+      if (!library[ndx].running && (!slot || library[ndx].last_used < slot->last_used)) slot = &library[ndx];
+   if (!slot || !library_load(slot, file)) { // read it as it runs instead
+      hal_sd_close(file);
+      if (slot) slot->last_used = 0;
+      if (debug >= 1) Serial.printf("script %s will be read from the SD card as it runs\n", name);
+      strcpy(library_stream_name, name);
+      return &library_stream; }
+   hal_sd_close(file);
+   strcpy(slot->name, name);
+   slot->last_used = ++library_uses;
+   slot->script.name = slot->name;
+   slot->script.commands = slot->commands;
+   int first_op = num_script_ops;
+   if (compile_script(&slot->script)) { // at the end of script_ops, and then moved into the slot
+      if (num_script_ops - first_op <= LIBRARY_OPS) {
+         memcpy(slot->ops, slot->script.ops, (num_script_ops - first_op) * sizeof(struct script_op_t));
+         slot->script.ops = slot->ops; }
+      else slot->script.ops = NULL; // (interpreted)
+      num_script_ops = first_op; }
+   if (debug >= 1) Serial.printf("script %s loaded from the SD card, %s\n", name, slot->script.ops ? "compiled" : "interpreted");
+   return &slot->script; }
+
+void run_library_file(struct script_t *sp, bool pause) { // run a script, reading it from the card as we go
+   int file = library_open(sp->name);
+   if (file < 0) {
+      error("can't read script", sp->name);
+      return; }
+   char line[CMDLENGTH];
+   int cyclenum = 0;
+   skip_lines = 0;
+   while (library_gets(file, line)) { // for each time unit
+      if (skip_lines > 0) {
+         --skip_lines;
+         if (debug >= 1) Serial.printf("*** skipped time unit %d: %s\n", ++cyclenum, line);
+         continue; }
+      if (debug >= 1) Serial.printf("*** time unit %d: %s\n", ++cyclenum, line);
+      scan_commands(line);
+      if (got_error) break;
+      if (!submit_movements(timeunit_usec)) break;
+      if (pause && !(wait_for_movements() && wait_to_continue())) break; }
+   hal_sd_close(file);
+   if (got_error || !wait_for_movements()) return;
+   if (debug >= 1) Serial.println ("end of script"); }
+
+struct library_slot_t *library_slot(struct script_t *sp) { // which slot a script is in, if any
+   for (int slot = 0; slot < LIBRARY_SLOTS; ++slot)
+      if (sp == &library[slot].script) return &library[slot];
+   return NULL; }
+
+void run_script(struct script_t *sp, bool pause) { // run a script, compiled if possible
+   struct library_slot_t *slot = library_slot(sp);
+   if (slot) ++slot->running;
+   if (!sp->commands) run_library_file(sp, pause);
+   else if (sp->ops) run_compiled_script(sp, pause);
+   else do_script(sp->commands, pause);
+   if (slot) --slot->running; }
+
+//****  running scripts together
+
+// "together" runs several compiled scripts at once, so that, say, A1 can be zeroed while
+// the carriage is reset on F. Each script claims the motors it moves, for as long as it
+// runs, and the time units of the scripts that are running are merged into shared time
+// units that take as long as the longest of them. A script that claims a motor another
+// one has still claimed waits for it to finish, so conflicting scripts are done one after
+// the other, in the order they were given.
+//
+// The connector pinions (FC, FPC, MPC) and the movable long pinions (MP) link the digit
+// wheels of F, A1 and A2 to each other, so a script that moves any of them claims every
+// motor, and runs by itself.
+
+#define MAX_TOGETHER 4
+#define MOTOR_SET_WORDS ((NUM_MOTORS + 31) / 32)
+
+struct together_t {                  // one of the scripts running together
+   struct script_t *sp;
+   const char **commands;            // the next time unit,
+   struct script_op_t *op;           //   and its compiled ops
+   uint32_t claims[MOTOR_SET_WORDS]; // the motors the script moves
+   int cyclenum, skip;
+   bool started, done; };
+
+void script_claims(struct script_t *sp, uint32_t *claims) { // find the motors a compiled script moves
+   memset(claims, 0, MOTOR_SET_WORDS * sizeof(uint32_t));
+   struct script_op_t *op = sp->ops;
+   for (const char **commands = sp->commands; *commands; ++op) { // for each time unit
+      commands += op_lines(op);
+      for (; op->motor_num != END_OF_UNIT; ++op) {
+         if (op->motor_num == SKIP_OP) continue;
+         if (op->motor_num == FC_L || op->motor_num == FPC_L || op->motor_num == MPC_L || op->motor_num == MP_L) {
+            memset(claims, 0xff, MOTOR_SET_WORDS * sizeof(uint32_t)); // (it links the digit wheels)
+            return; }
+         claims[op->motor_num / 32] |= 1ul << (op->motor_num % 32); } } }
+
+bool claims_conflict(const uint32_t *a, const uint32_t *b) {
+   for (int word = 0; word < MOTOR_SET_WORDS; ++word)
+      if (a[word] & b[word]) return true;
+   return false; }
+
+bool run_together(struct together_t *scripts, int num_scripts) { // return false if aborted
+   int running = num_scripts, time_units = 0;
+   while (running > 0) { // for each shared time unit
+      for (int ndx = 0; ndx < num_scripts; ++ndx) { // start the scripts that can be
+         struct together_t *tp = &scripts[ndx];
+         bool conflict = false;
+         for (int other = 0; other < num_scripts && !tp->started && !tp->done; ++other)
+            conflict |= other != ndx && !scripts[other].done && (scripts[other].started || other < ndx)
+                        && claims_conflict(tp->claims, scripts[other].claims);
+         if (!tp->started && !tp->done && !conflict) {
+            tp->started = true;
+            if (debug >= 1) Serial.printf("*** starting script %s at time unit %d\n", tp->sp->name, time_units + 1); } }
+      unsigned long duration_usec = 0;
+      ++time_units;
+      for (struct together_t *tp = scripts; tp < scripts + num_scripts; ++tp)
+         if (tp->started && !tp->done) { // queue the script's next time unit
+            int lines = op_lines(tp->op);
+            if (debug >= 1) Serial.printf("*** time unit %d: %s unit %d: %s\n", time_units, tp->sp->name, tp->cyclenum + 1, *tp->commands);
+            tp->cyclenum += lines;
+            tp->commands += lines;
+            duration_usec = max(duration_usec, unit_duration(tp->op));
+            for (; tp->op->motor_num != END_OF_UNIT; ++tp->op) {
+               if (tp->op->motor_num != SKIP_OP) queue_op(tp->op);
+               else if (skip_condition(tp->op->position, tp->op->distance)) tp->skip = tp->op->usteps; }
+            ++tp->op; }
+      if (!submit_movements(duration_usec)) return false;
+      for (struct together_t *tp = scripts; tp < scripts + num_scripts; ++tp)
+         if (tp->started && !tp->done) {
+            while (tp->skip > 0 && *tp->commands) { // as in run_compiled_script
+               int lines = op_lines(tp->op);
+               if (debug >= 1) Serial.printf("*** skipped %s unit %d: %s\n", tp->sp->name, tp->cyclenum + 1, *tp->commands);
+               tp->cyclenum += lines;
+               tp->commands += lines;
+               tp->skip -= lines;
+               while (tp->op->motor_num != END_OF_UNIT) ++tp->op;
+               ++tp->op; }
+            tp->skip = 0;
+            if (!*tp->commands) { // it's finished, and its motors can be claimed by another
+               tp->done = true;
+               --running; } } }
+   if (!wait_for_movements()) return false;
+   if (debug >= 1) Serial.printf("end of scripts, in %d time units\n", time_units);
+   return true; }
+
+void do_together(const char **pptr) { // together <script> <script> ...
+   struct together_t scripts[MAX_TOGETHER];
+   int num_scripts = 0;
+   while (**pptr && **pptr != ';' && !got_error) {
+      struct script_t *sp = find_script(pptr);
+      if (!sp) break;
+      if (num_scripts >= MAX_TOGETHER) error("too many scripts", sp->name);
+      else if (!sp->commands || !sp->ops) error("only compiled scripts can be run together", sp->name);
+      else {
+         struct together_t *tp = &scripts[num_scripts++];
+         memset(tp, 0, sizeof(*tp));
+         tp->sp = sp;
+         tp->commands = sp->commands;
+         tp->op = sp->ops;
+         script_claims(sp, tp->claims);
+         struct library_slot_t *slot = library_slot(sp);
+         if (slot) ++slot->running; } } // (so it isn't reused while we look for the others)
+   if (!got_error && num_scripts > 0) run_together(scripts, num_scripts);
+   while (num_scripts > 0) {
+      struct library_slot_t *slot = library_slot(scripts[--num_scripts].sp);
+      if (slot) --slot->running; } }
+
+//****  benchmarks
+
+// "bench" runs compiled scripts, or a synthetic time unit that moves every motor as fast
+// as it can go, with the motors disabled so that nothing physically moves. It reports the
+// microstep rate the step engine achieved, how much of the CPU it took, and for scripts
+// the shortest time unit that both the motors' speed limits and the CPU could sustain.
+// The statistics are reset at the start of each benchmark, so "stats" afterwards shows
+// the details of the last one.
+
+unsigned long min_move_usec(struct motord_t *pmd, unsigned usteps) { // the shortest time for a movement
+   float n = usteps;
+   float a = pmd->accel * 1e-12f, v = pmd->max_velocity * 1e-6f; // in microsteps/usec/usec and microsteps/usec
+   if (!pmd->accel) return v ? n / v : 0;
+   if (v && n * a >= v * v) return n / v + v / a; // a trapezoid with a cruise at the maximum velocity
+   return 2 * sqrtf(n / a); } // a triangle
+
+unsigned max_move_usteps(struct motord_t *pmd, unsigned long duration_usec) { // the most microsteps in a movement
+   float T = duration_usec;
+   float a = pmd->accel * 1e-12f, v = pmd->max_velocity * 1e-6f;
+   if (!pmd->accel) return v ? v * T : duration_usec / 10;
+   if (v && T * a >= 2 * v) return v * (T - v / a) * 0.99f; // (a little less, so rounding doesn't warn)
+   return a * T * T / 4 * 0.99f; }
+
+void bench_report(const char *name, unsigned long unit_usteps_max, unsigned long motor_min_usec) {
+   unsigned long elapsed_usec = micros() - stats.reset_usec;
+   unsigned long cpu_percent_x100 = elapsed_usec ? stats.interrupt_usec * 10000ULL / elapsed_usec : 0;
+   Serial.printf("%-8s %4lu units, %7lu usteps in %6lu msec: %6lu usteps/sec, CPU %3lu.%02lu%% used, %3lu.%02lu%% headroom, %lu overran",
+                 name, stats.units, stats.usteps, elapsed_usec / 1000,
+                 elapsed_usec ? (unsigned long)(stats.usteps * 1000000ULL / elapsed_usec) : 0,
+                 cpu_percent_x100 / 100, cpu_percent_x100 % 100,
+                 (10000 - min(cpu_percent_x100, 10000UL)) / 100, (10000 - min(cpu_percent_x100, 10000UL)) % 100,
+                 stats.units_overrun);
+   if (unit_usteps_max) { // a script: the busiest unit must fit in the shortest time unit, using all of the CPU
+      unsigned long cpu_min_usec = stats.usteps ? (unsigned long)(unit_usteps_max * (unsigned long long)stats.interrupt_usec / stats.usteps) : 0;
+      Serial.printf(", min timeunit %lu msec (motors %lu.%03lu, CPU %lu.%03lu)",
+                    (max(motor_min_usec, cpu_min_usec) + 999) / 1000,
+                    motor_min_usec / 1000, motor_min_usec % 1000, cpu_min_usec / 1000, cpu_min_usec % 1000); }
+   Serial.println(); }
+
+bool bench_script(struct script_t *sp, int reps) { // return false if aborted
+   if (!sp->ops) {
+      Serial.printf("%-8s isn't compiled, so it can't be benchmarked\n", sp->name);
+      return true; }
+   unsigned long unit_usteps_max = 0, motor_min_usec = 0;
+   struct script_op_t *op = sp->ops;
+   for (const char **cmd = sp->commands; *cmd; ++op) { // find the busiest, and the slowest, time unit
+      unsigned long usteps = 0, lines = op_lines(op); // (a merged unit counts as its average line)
+      cmd += lines;
+      for (; op->motor_num != END_OF_UNIT; ++op) {
+         if (op->motor_num == SKIP_OP) continue; // (the benchmark never skips)
+         usteps += op->usteps;
+         motor_min_usec = max(motor_min_usec, min_move_usec(motor_num_to_descr[op->motor_num], op->usteps) / lines); }
+      unit_usteps_max = max(unit_usteps_max, usteps / lines); }
+   reset_stats();
+   for (int rep = 0; rep < reps; ++rep) {
+      set_neutral_positions(); // where the script was compiled from
+      if (!run_compiled_script(sp, false)) return false; }
+   bench_report(sp->name, unit_usteps_max, motor_min_usec);
+   return true; }
+
+bool bench_motors(int reps) { // move all the motors at their maximum speed
+   reset_stats();
+   for (int rep = 0; rep < reps; ++rep) {
+      for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+         queue_usteps(pmd, rep & 1, max_move_usteps(pmd, timeunit_usec)); // back and forth
+      if (!submit_movements(timeunit_usec)) return false; }
+   if (!wait_for_movements()) return false;
+   bench_report("motors", 0, 0);
+   return true; }
+
+void do_bench(const char **pptr) { // bench {<script> | motors | all} <repetitions>
+   char word[MAX_WORD];
+   struct script_t *sp = NULL;
+   int reps;
+   const char *savep = *pptr;
+   if (!scan_word(pptr, word)
+         || !(word_is(word, "all") || word_is(word, "motors") || (sp = (struct script_t *) find_keyword(word, KW_SCRIPTS)))) {
+      error("bad benchmark", savep);
+      return; }
+   if (!scan_int(pptr, &reps, 1, 1000)) {
+      error("bad repetitions", *pptr);
+      return; }
+   struct { // what the movements that don't happen would change
+      int position;
+      long net_usteps, index_usteps, ustep_fraction; } saved[NUM_MOTORS];
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
+      saved[pmd->motor_number].position = pmd->current_position;
+      saved[pmd->motor_number].net_usteps = pmd->net_usteps; // (the step interrupt counts them anyway)
+      saved[pmd->motor_number].index_usteps = pmd->index_usteps;
+      saved[pmd->motor_number].ustep_fraction = pmd->ustep_fraction; }
+   struct shadow_t saved_shadow = shadow;
+   shadow_forget(); // so that the scripts aren't skipped
+   int saved_debug = debug;
+   bool motors_were_on = digitalRead(MOTOR_ENB) == LOW;
+   digitalWrite(MOTOR_ENB, HIGH); // nothing moves
+   dry_run = true;
+   debug = 0; // measure the motion, not the console output
+   Serial.printf("benchmarks with a %lu msec time unit and %d repetitions:\n", timeunit_usec / 1000, reps);
+   bool ok = true;
+   if (sp) ok = bench_script(sp, reps);
+   else if (word_is(word, "motors")) ok = bench_motors(reps);
+   else { // all of them
+      for (sp = named_scripts; ok && sp->name; ++sp)
+         ok = bench_script(sp, reps);
+      if (ok) ok = bench_motors(reps); }
+   if (!ok) Serial.println("benchmark aborted");
+   debug = saved_debug;
+   dry_run = false;
+   if (motors_were_on) digitalWrite(MOTOR_ENB, LOW);
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd) {
+      pmd->current_position = saved[pmd->motor_number].position;
+      pmd->net_usteps = saved[pmd->motor_number].net_usteps; // so the index switches don't see lost steps
+      pmd->index_usteps = saved[pmd->motor_number].index_usteps;
+      pmd->ustep_fraction = saved[pmd->motor_number].ustep_fraction; }
+   shadow = saved_shadow; }
+
+// "sweep" runs a script with the motors really moving, a few times at each of a series of
+// decreasing time units, to find the shortest one that is still reliable on the rig: no
+// lost steps seen at the index switches, and no aborts or errors. F and A have to have been
+// homed to their switches first, and a run only counts as reliable if the switches were
+// checked during it at least once; otherwise it is "unverified". The digit wheel model is
+// forgotten before each run so that nothing is skipped. It writes CSV lines of
+//    script,timeunit_msec,run,time_units,wall_msec,over_limits,reliable
+// for simulations/timing_simulator/muldiv_timing.py to plot with read_sweep(), and stops
+// at the first time unit that wasn't reliable. over_limits counts the movements that had
+// to exceed a motor's configured acceleration or speed, which often means lost steps, but
+// the limits are conservative, so only the index switches decide.
+
+#define SWEEP_RUNS 3                 // how many times the script is run at each time unit
+
+bool sweep_run(struct script_t *sp, int timeunit_msec, int run, unsigned long *wall_usec) { // return true if it was reliable
+   unsigned long lost_before = stats.lost_step_faults, units_before = stats.units, over_before = stats.over_limits;
+   unsigned long checks_before = stats.index_checks;
+   unsigned long start_usec = micros();
+   shadow_forget();
+   got_error = aborted = false;
+   run_script(sp, false);
+   *wall_usec = micros() - start_usec;
+   bool verified = stats.index_checks != checks_before; // (or we don't know about lost steps)
+   bool reliable = !got_error && !aborted && stats.lost_step_faults == lost_before;
+   Serial.printf("%s,%d,%d,%lu,%lu,%lu,%s\n", sp->name, timeunit_msec, run, stats.units - units_before,
+                 *wall_usec / 1000, stats.over_limits - over_before, !reliable ? "0" : verified ? "1" : "unverified");
+   if (reliable && !verified)
+      Serial.printf("%s didn't pass the F or A index switch, so it can't be checked for lost steps\n", sp->name);
+   return reliable && verified; }
+
+void do_sweep(const char **pptr) { // sweep <script> <min_msec> <max_msec> <step_msec>
+   struct script_t *sp = find_script(pptr);
+   int min_msec, max_msec, step_msec;
+   if (!sp) return;
+   if (!scan_int(pptr, &min_msec, 10, 5000) || !scan_int(pptr, &max_msec, min_msec, 5000) // (as for "timeunit")
+         || !scan_int(pptr, &step_msec, 1, 5000)) {
+      error("bad time units", *pptr);
+      return; }
+   if (!motor_num_to_descr[F_R]->index_referenced || !motor_num_to_descr[A_R]->index_referenced) {
+      error("F and A have to be zeroed first, so lost steps can be seen", "");
+      return; }
+   unsigned long saved_timeunit_usec = timeunit_usec;
+   int saved_debug = debug;
+   int lowest_msec = 0;
+   unsigned long lowest_wall_usec = 0;
+   debug = 0; // just the CSV
+   Serial.println("script,timeunit_msec,run,time_units,wall_msec,over_limits,reliable");
+   for (int msec = max_msec; msec >= min_msec; msec -= step_msec) {
+      timeunit_usec = msec * 1000L;
+      bool reliable = true;
+      unsigned long total_usec = 0, wall_usec;
+      for (int run = 1; run <= SWEEP_RUNS && reliable; ++run) {
+         reliable = sweep_run(sp, msec, run, &wall_usec);
+         total_usec += wall_usec; }
+      if (!reliable || check_abort()) break;
+      lowest_msec = msec;
+      lowest_wall_usec = total_usec / SWEEP_RUNS; }
+   timeunit_usec = saved_timeunit_usec;
+   debug = saved_debug;
+   if (lowest_msec) Serial.printf("the lowest reliable time unit for %s is %d msec, which takes %lu.%03lu seconds\n",
+                                     sp->name, lowest_msec, lowest_wall_usec / 1000000, lowest_wall_usec / 1000 % 1000);
+   else Serial.printf("%s couldn't be shown to be reliable even with a %d msec time unit\n", sp->name, max_msec);
+   got_error = false; }
+
+//****  barrel programs
+
+// The barrel assembler (simulations/component_simulator/barrel_assembler.py) can download
+// a microprogram for the Analytical Engine's control barrel, which we then run here, one
+// vertical after another, with no round trip to the host for each one.
+//
+// A vertical is a mask of the studs that are "on" in that column of the barrel. Each stud
+// is defined by a kind and, for "do" studs, the commands that it stands for, typically a
+// script like "run add". The commands of all the "do" studs of a vertical are done as one
+// command line, so that primitive movements from several studs share a time unit.
+// Then the barrel moves to the next vertical by the sum of its MOVE1, MOVE2, and MOVE4
+// studs, backwards if there is a MOVEBACK stud, and one more in the same direction if an
+// IFRUNUP stud sees the "running up" condition, or an IFNORUNUP stud doesn't. A STOP stud
+// stops the barrel after its vertical is done. All of that follows the stud semantics in
+// component.py, except that we don't model the phases within a cycle. A vertical without
+// any of the jump studs moves to the next one, as the assembler would have made it do,
+// and one that would jump to itself is an error, since it would never get anywhere.
+//
+// The running up condition is set with "barrel runup on", which "do" commands can include.
+// Because it is set when the commands are parsed, not when they are done, the verticals
+// are queued behind each other like the lines of a script.
+
+#define MAX_VERTICALS 128
+#define MAX_BARREL_STUDS 32          // stud pairs, which is the number of bits in a vertical's mask
+#define STUD_NAME_LENGTH 24
+#define STUD_COMMAND_LENGTH 48
+
+enum stud_kind_t {STUD_NONE, STUD_DO, STUD_MOVE1, STUD_MOVE2, STUD_MOVE4, STUD_MOVEBACK, STUD_IFRUNUP, STUD_IFNORUNUP, STUD_STOP };
+const char *stud_kinds[] = {"none", "do", "move1", "move2", "move4", "moveback", "ifrunup", "ifnorunup", "stop", NULL };
+
+struct barrel_stud_t {
+   char name[STUD_NAME_LENGTH];         // as in the assembler
+   byte kind;                           // a stud_kind_t
+   char command[STUD_COMMAND_LENGTH];   // for STUD_DO, what it does
+} barrel_studs[MAX_BARREL_STUDS];
+uint32_t barrel_verticals[MAX_VERTICALS]; // the "on" studs of each vertical
+int num_verticals = 0;            // (IFRUNUP and IFNORUNUP test running_up, from the digit wheel model)
+bool barrel_running = false;
+
+void barrel_clear(void) {
+   memset(barrel_studs, 0, sizeof(barrel_studs));
+   num_verticals = 0;
+   running_up = false; }
+
+void barrel_show(void) {
+   Serial.printf("%d verticals\n", num_verticals);
+   for (int stud = 0; stud < MAX_BARREL_STUDS; ++stud)
+      if (barrel_studs[stud].name[0])
+         Serial.printf("  stud %2d %-16s %s %s\n", stud, barrel_studs[stud].name, stud_kinds[barrel_studs[stud].kind],
+                       barrel_studs[stud].command);
+   for (int vertical = 0; vertical < num_verticals; ++vertical) {
+      Serial.printf("  vertical %3d:", vertical);
+      for (int stud = 0; stud < MAX_BARREL_STUDS; ++stud)
+         if (barrel_verticals[vertical] & (1ul << stud)) Serial.printf(" %s", barrel_studs[stud].name);
+      Serial.println(); } }
+
+bool run_barrel(int vertical) { // run from a vertical until a STOP; return false if aborted or there was an error
+   unsigned long verticals_done = 0;
+   barrel_running = true;
+   aborted = false;
+   while (1) {
+      char line[2 * CMDLENGTH] = "";
+      int distance = 0;
+      bool backwards = false, skip = false, stop = false;
+      for (int stud = 0; stud < MAX_BARREL_STUDS; ++stud)
+         if (barrel_verticals[vertical] & (1ul << stud)) switch (barrel_studs[stud].kind) {
+                  case STUD_DO:
+                     if (strlen(line) + strlen(barrel_studs[stud].command) + 3 > sizeof(line)) {
+                        error("too many commands in vertical", barrel_studs[stud].name);
+                        break; }
+                     if (line[0]) strcat(line, "; ");
+                     strcat(line, barrel_studs[stud].command);
+                     break;
+                  case STUD_MOVE1: distance += 1; break;
+                  case STUD_MOVE2: distance += 2; break;
+                  case STUD_MOVE4: distance += 4; break;
+                  case STUD_MOVEBACK: backwards = true; break;
+                  case STUD_IFRUNUP: skip = true; break;
+                  case STUD_IFNORUNUP: skip = true; break;
+                  case STUD_STOP: stop = true; break; }
+      if (!distance && !backwards) distance = 1; // no jump studs means the next one, as in barrel_assembler.py
+      if (debug >= 1) Serial.printf("*** barrel vertical %d: %s\n", vertical, line);
+      if (!got_error && line[0]) {
+         scan_commands(line);
+         if (!got_error && !submit_movements(timeunit_usec)) break; }
+      if (!got_error && !aborted) check_abort(); // (even if it had no commands, so ESC can always stop us)
+      if (got_error || aborted) break;
+      ++verticals_done;
+      if (stop) break;
+      if (skip) { // the conditional studs are tested after the vertical's commands
+         bool condition = false;
+         for (int stud = 0; stud < MAX_BARREL_STUDS; ++stud)
+            if (barrel_verticals[vertical] & (1ul << stud))
+               condition |= (barrel_studs[stud].kind == STUD_IFRUNUP && running_up)
+                            || (barrel_studs[stud].kind == STUD_IFNORUNUP && !running_up);
+         if (condition) ++distance; }
+      int jump = (backwards ? num_verticals - distance % num_verticals : distance) % num_verticals;
+      if (jump == 0) {
+         char num[12];
+         sprintf(num, "%d", vertical);
+         error("the vertical jumps to itself", num);
+         break; }
+      vertical = (vertical + jump) % num_verticals; }
+   barrel_running = false;
+   if (!got_error && !aborted && wait_for_movements()) {
+      Serial.printf("barrel stopped at vertical %d after %lu verticals\n", vertical, verticals_done);
+      return true; }
+   Serial.printf("barrel program stopped at vertical %d\n", vertical);
+   return false; }
+
+void scan_stud_name(const char **pptr, char *name) { // stud names have underscores, so they aren't words
+   skip_blanks(pptr);
+   int len = 0;
+   for (; **pptr && **pptr != ' ' && **pptr != '\t' && **pptr != ';'; ++*pptr)
+      if (len < STUD_NAME_LENGTH - 1) name[len++] = **pptr;
+   name[len] = 0;
+   skip_blanks(pptr); }
+
+void do_barrel(const char **pptr) { // barrel {clear | stud | vertical | runup | show | run} ...
+   char word[MAX_WORD];
+   const char *savep = *pptr;
+   int num;
+   scan_word(pptr, word);
+   if (word_is(word, "clear")) barrel_clear();
+   else if (word_is(word, "stud")) {
+      if (!scan_int(pptr, &num, 0, MAX_BARREL_STUDS - 1)) {
+         error("bad stud number", *pptr);
+         return; }
+      struct barrel_stud_t *sp = &barrel_studs[num];
+      char name[STUD_NAME_LENGTH];
+      scan_stud_name(pptr, name);
+      savep = *pptr;
+      scan_word(pptr, word);
+      int kind;
+      for (kind = 0; stud_kinds[kind] && !word_is(word, stud_kinds[kind]); ++kind) ;
+      if (!name[0] || !stud_kinds[kind]) {
+         error("bad stud", savep);
+         return; }
+      strcpy(sp->name, name);
+      sp->kind = kind;
+      sp->command[0] = 0;
+      if (kind == STUD_DO) { // the rest of the line
+         if (strlen(*pptr) >= STUD_COMMAND_LENGTH) {
+            error("stud command is too long", *pptr);
+            return; }
+         strcpy(sp->command, *pptr);
+         *pptr += strlen(*pptr); } }
+   else if (word_is(word, "vertical")) {
+      unsigned long mask;
+      int nch;
+      if (!scan_int(pptr, &num, 0, MAX_VERTICALS - 1) || sscanf(*pptr, "%lx%n", &mask, &nch) != 1) {
+         error("bad vertical", *pptr);
+         return; }
+      *pptr += nch;
+      barrel_verticals[num] = mask;
+      if (num >= num_verticals) num_verticals = num + 1; }
+   else if (word_is(word, "runup")) {
+      scan_word(pptr, word);
+      if (word_is(word, "on") || word_is(word, "off")) running_up = word_is(word, "on");
+      else error("bad runup option", savep); }
+   else if (word_is(word, "show")) barrel_show();
+   else if (word_is(word, "run")) {
+      num = 0;
+      if (**pptr && **pptr != ';' && !scan_int(pptr, &num, 0, num_verticals - 1)) error("bad vertical", *pptr);
+      else if (barrel_running) error("the barrel is already running", "");
+      else if (num_verticals == 0) error("no barrel program", "");
+      else run_barrel(num); }
+   else error("bad barrel command", savep); }
+
+//****  rescheduling scripts
+
+// "reschedule" looks for an equivalent schedule of a script or barrel program that takes
+// fewer time units, shows it, and can write it to the SD card as a script that "run" then
+// loads from the library. It is mostly meant for the host build (see host/hal_host.cpp),
+// where the searching costs no machine time, but it works the same way on the Teensy.
+//
+// Each command is first compiled by itself, as compile_script() would, to find the motor
+// it moves and which stacks of digit wheels that can affect: for the locks, the fingers
+// and the carry mechanism just their own, for the connectors and the movable long pinions
+// all of them, and for the F and A rotators all of them while any connector is meshed.
+// Commands in different time units that can affect the same stack have to stay in that
+// order, and ones in the same time unit that can, or that are timed "after" each other,
+// have to stay together. Each command is then moved into the earliest time unit that
+// allows, which is the shortest schedule there is for those rules, as long as the time
+// unit is still short enough to be read back from the card.
+//
+// A "skipif" is a fence: its time unit isn't changed, nothing is moved past it or past
+// the line it skips to, and the number of lines it skips is recounted. A barrel program
+// is followed from vertical 0 to its STOP stud into one long script, and a vertical that
+// only does "run <script>" becomes the lines of that script. Barrel programs with
+// conditional studs can't be rescheduled, because the path through them isn't known.
+//
+// The new schedule is checked by compiling it the normal way, which must not find any
+// interlock errors from locked() or axles that move twice in a time unit, and which must
+// move each motor the same way in the same order as before. If it fails, the stretches
+// between fences are rescheduled one at a time, and the ones that fail are kept as is.
+
+#define SCHEDULE_LINES 128           // the most time units that can be rescheduled,
+#define SCHEDULE_CMDS 256            //   the most commands,
+#define SCHEDULE_TEXT 4096           //   and the most characters
+#define ALL_STACKS ((1 << NUM_STACKS) - 1)
+
+struct sched_cmd_t {
+   const char *text;                 // the command, in sched_text
+   int line;                         // the time unit it was in
+   int end_line;                     // the end of the script it came from, for skips of the rest
+   struct script_op_t op;            // what it compiles into
+   byte stacks;                      // the digit wheel stacks it can affect, as a bit mask
+   int group;                        // the first command of its time unit that it has to stay with
+   int unit;                         // the time unit it is moved to
+   bool placed;                      //   once that is decided
+} sched_cmds[SCHEDULE_CMDS];
+int sched_first_cmd[SCHEDULE_LINES + 1]; // the first command of each line, and one past the last line
+bool sched_fence[SCHEDULE_LINES + 1];    // does the line start a stretch?
+bool sched_fixed[SCHEDULE_LINES];        // is it a "skipif" line, which isn't changed?
+int num_sched_lines, num_sched_cmds, sched_text_used;
+char sched_text[SCHEDULE_TEXT];
+const char *sched_out_lines[SCHEDULE_LINES + 1]; // the new schedule
+char sched_out_text[2 * SCHEDULE_TEXT];
+
+bool sched_add_line(const char *line) { // add a time unit of commands, separated by semicolons
+   const char *ptr = line;
+   int first_cmd = num_sched_cmds;
+   if (num_sched_lines >= SCHEDULE_LINES) {
+      error("too many time units to reschedule", line);
+      return false; }
+   while (*ptr) {
+      skip_blanks(&ptr);
+      const char *end = strchr(ptr, ';');
+      if (!end) end = ptr + strlen(ptr);
+      int len = end - ptr;
+      while (len > 0 && (ptr[len - 1] == ' ' || ptr[len - 1] == '\t')) --len;
+      if (len > 0) {
+         if (num_sched_cmds >= SCHEDULE_CMDS || sched_text_used + len + 1 > SCHEDULE_TEXT) {
+            error("too many commands to reschedule", line);
+            return false; }
+         struct sched_cmd_t *cp = &sched_cmds[num_sched_cmds++];
+         memcpy(sched_text + sched_text_used, ptr, len);
+         sched_text[sched_text_used + len] = 0;
+         cp->text = sched_text + sched_text_used;
+         sched_text_used += len + 1;
+         cp->line = num_sched_lines;
+         cp->end_line = -1; } // (the end of everything)
+      ptr = *end ? end + 1 : end; }
+   if (num_sched_cmds > first_cmd) sched_first_cmd[++num_sched_lines] = num_sched_cmds;
+   return true; }
+
+bool sched_add_script(struct script_t *sp) { // add all the lines of a script
+   int first_cmd = num_sched_cmds;
+   if (!sp->commands) {
+      error("can't reschedule a script that is read as it runs", sp->name);
+      return false; }
+   for (const char **cmd = sp->commands; *cmd; ++cmd)
+      if (!sched_add_line(*cmd)) return false;
+   for (int ndx = first_cmd; ndx < num_sched_cmds; ++ndx)
+      sched_cmds[ndx].end_line = num_sched_lines;
+   return true; }
+
+bool sched_add_barrel(void) { // add the verticals of the barrel program from 0 to the STOP
+   bool visited[MAX_VERTICALS] = {false };
+   if (num_verticals == 0) {
+      error("no barrel program", "");
+      return false; }
+   for (int vertical = 0; ; ) {
+      char line[2 * CMDLENGTH] = "";
+      int distance = 0;
+      bool backwards = false, stop = false;
+      if (visited[vertical]) {
+         error("the barrel program doesn't stop", "");
+         return false; }
+      visited[vertical] = true;
+      for (int stud = 0; stud < MAX_BARREL_STUDS; ++stud)
+         if (barrel_verticals[vertical] & (1ul << stud)) switch (barrel_studs[stud].kind) {
+                  case STUD_DO: // as in run_barrel()
+                     if (strlen(line) + strlen(barrel_studs[stud].command) + 3 > sizeof(line)) {
+                        error("too many commands in vertical", barrel_studs[stud].name);
+                        return false; }
+                     if (line[0]) strcat(line, "; ");
+                     strcat(line, barrel_studs[stud].command);
+                     break;
+                  case STUD_MOVE1: distance += 1; break;
+                  case STUD_MOVE2: distance += 2; break;
+                  case STUD_MOVE4: distance += 4; break;
+                  case STUD_MOVEBACK: backwards = true; break;
+                  case STUD_IFRUNUP:
+                  case STUD_IFNORUNUP:
+                     error("can't reschedule a conditional stud", barrel_studs[stud].name);
+                     return false;
+                  case STUD_STOP: stop = true; break; }
+      if (!distance && !backwards) distance = 1; // as in run_barrel()
+      char word[MAX_WORD];
+      const char *ptr = line;
+      if (scan_word(&ptr, word) && word_is(word, "run") && !strchr(ptr, ';')) { // it becomes the script's lines
+         struct script_t *sp = find_script(&ptr);
+         if (!sp || !sched_add_script(sp)) return false; }
+      else if (!sched_add_line(line)) return false;
+      if (stop) return true;
+      vertical = (vertical + (backwards ? num_verticals - distance % num_verticals : distance)) % num_verticals; } }
+
+byte sched_stacks(int motor_num) { // which digit wheel stacks a movement of the motor can affect, now
+   switch (motor_num) {
+      case F_L: case FK_R: case C_R: case W_R: case N_L: case H_R: case H_L: // (the carry mechanism is F's)
+         return 1 << STACK_F;
+      case A1K_R: return 1 << STACK_A1;
+      case A2K_R: return 1 << STACK_A2;
+      case A_L: return 1 << STACK_A1 | 1 << STACK_A2;
+      case F_R: case A_R:
+         if (!motor_num_to_descr[FC_L]->current_position && !motor_num_to_descr[FPC_L]->current_position
+               && !motor_num_to_descr[MPC_L]->current_position) // nothing links it to the other stacks
+            return motor_num == F_R ? 1 << STACK_F : 1 << STACK_A1 | 1 << STACK_A2;
+         return ALL_STACKS;
+      default: return ALL_STACKS; } } // the connectors and the long pinions, skips, and motors we don't know about
+
+bool sched_compile(void) { // compile each command by itself to find what it does, as in compile_script()
+   int saved_positions[NUM_MOTORS];
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      saved_positions[pmd->motor_number] = pmd->current_position;
+   set_neutral_positions();
+   int first_op = num_script_ops, errors = interlock_errors;
+   compiling = compile_ok = true;
+   for (int line = 0; line < num_sched_lines && compile_ok; ++line) {
+      num_script_ops = unit_first_op = first_op;
+      for (int ndx = sched_first_cmd[line]; ndx < sched_first_cmd[line + 1] && compile_ok; ++ndx) {
+         struct sched_cmd_t *cp = &sched_cmds[ndx];
+         int op = num_script_ops;
+         scan_commands(cp->text);
+         if (got_error || num_script_ops != op + 1) {
+            if (!got_error) Serial.printf("can't reschedule: %s\n", cp->text);
+            Serial.printf("  in time unit %d\n", line + 1);
+            compile_ok = false; }
+         else {
+            cp->op = script_ops[op];
+            cp->stacks = sched_stacks(cp->op.motor_num); } } }
+   bool ok = compile_ok && interlock_errors == errors;
+   compiling = got_error = false;
+   num_script_ops = first_op;
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      pmd->current_position = saved_positions[pmd->motor_number];
+   return ok; }
+
+int sched_skip_target(struct sched_cmd_t *cp) { // the line a "skipif" goes to
+   int target = cp->line + 1 + (int)cp->op.usteps;
+   return target < cp->end_line ? target : cp->end_line; }
+
+void sched_fences(void) { // find the stretches that can be rescheduled
+   for (int line = 0; line <= num_sched_lines; ++line)
+      sched_fence[line] = line == 0;
+   for (int ndx = 0; ndx < num_sched_cmds; ++ndx) {
+      struct sched_cmd_t *cp = &sched_cmds[ndx];
+      if (cp->end_line < 0) cp->end_line = num_sched_lines;
+      sched_fixed[cp->line] = false; }
+   for (int ndx = 0; ndx < num_sched_cmds; ++ndx) {
+      struct sched_cmd_t *cp = &sched_cmds[ndx];
+      if (cp->op.motor_num == SKIP_OP)
+         sched_fixed[cp->line] = sched_fence[cp->line] = sched_fence[cp->line + 1]
+                                 = sched_fence[sched_skip_target(cp)] = true; } }
+
+bool sched_together(struct sched_cmd_t *a, struct sched_cmd_t *b) { // do they have to be in the same time unit?
+   return (a->stacks & b->stacks) || a->op.after == b->op.motor_num || b->op.after == a->op.motor_num; }
+
+int sched_stretch(int first_line, int end_line, int base, bool as_is) { // reschedule the lines of a stretch
+   // starting at time unit "base", and return how many time units it takes
+   int first_cmd = sched_first_cmd[first_line], units = 0;
+   for (int line = first_line; line < end_line; ++line) {
+      int first = sched_first_cmd[line], last = sched_first_cmd[line + 1];
+      for (int ndx = first; ndx < last; ++ndx) { // the earliest each command can be, and what it stays with
+         struct sched_cmd_t *cp = &sched_cmds[ndx];
+         cp->unit = as_is ? base + line - first_line : base;
+         cp->group = ndx;
+         cp->placed = as_is;
+         for (int prev = first_cmd; prev < first && !as_is; ++prev)
+            if (sched_cmds[prev].stacks & cp->stacks) cp->unit = max(cp->unit, sched_cmds[prev].unit + 1);
+         for (int other = first; other < ndx; ++other)
+            if (sched_together(&sched_cmds[other], cp) && sched_cmds[other].group != cp->group) {
+               int from = max(sched_cmds[other].group, cp->group), to = min(sched_cmds[other].group, cp->group);
+               for (int member = first; member <= ndx; ++member)
+                  if (sched_cmds[member].group == from) sched_cmds[member].group = to; } }
+      for (int group = first; group < last && !as_is; ++group) { // put each group in the earliest time unit it fits in
+         int unit = base, len = 0;
+         for (int ndx = group; ndx < last; ++ndx)
+            if (sched_cmds[ndx].group == group) {
+               unit = max(unit, sched_cmds[ndx].unit);
+               len += strlen(sched_cmds[ndx].text) + 2; }
+         if (len == 0) continue; // (it's in an earlier group)
+         while (1) {
+            int used = 0;
+            for (int ndx = first_cmd; ndx < last; ++ndx)
+               if (sched_cmds[ndx].placed && sched_cmds[ndx].unit == unit) used += strlen(sched_cmds[ndx].text) + 2;
+            if (used + len <= CMDLENGTH - 1) break;
+            ++unit; }
+         for (int ndx = group; ndx < last; ++ndx)
+            if (sched_cmds[ndx].group == group) {
+               sched_cmds[ndx].unit = unit;
+               sched_cmds[ndx].placed = true; } } }
+   for (int ndx = first_cmd; ndx < sched_first_cmd[end_line]; ++ndx)
+      units = max(units, sched_cmds[ndx].unit + 1 - base);
+   return units; }
+
+int sched_schedule(const bool *keep) { // reschedule all the stretches, except those to keep; return the time units
+   int units = 0;
+   for (int line = 0; line < num_sched_lines; ) {
+      int end_line = line + 1;
+      while (end_line < num_sched_lines && !sched_fence[end_line]) ++end_line;
+      bool as_is = keep[line] || sched_fixed[line];
+      int stretch_units = sched_stretch(line, end_line, units, as_is);
+      if (!as_is && stretch_units > end_line - line) // (because the time units got too long)
+         stretch_units = sched_stretch(line, end_line, units, true);
+      units += stretch_units;
+      line = end_line; }
+   return units; }
+
+bool sched_build(int units) { // make the lines of the new schedule
+   int used = 0;
+   for (int unit = 0; unit < units; ++unit) {
+      char *line = sched_out_text + used;
+      int len = 0;
+      for (int ndx = 0; ndx < num_sched_cmds; ++ndx) {
+         struct sched_cmd_t *cp = &sched_cmds[ndx];
+         if (cp->unit != unit) continue;
+         char skip[48];
+         const char *text = cp->text;
+         if (cp->op.motor_num == SKIP_OP) { // with the lines recounted
+            int condition = cp->op.position, target = sched_skip_target(cp);
+            text = skip;
+            snprintf(skip, sizeof(skip), "%s %s %s", condition & SKIP_UNLESS ? "skipunless" : "skipif",
+                     skip_conditions[condition & ~SKIP_UNLESS], shadow.stacks[cp->op.distance].name);
+            if (target < num_sched_lines)
+               snprintf(skip + strlen(skip), sizeof(skip) - strlen(skip), " %d",
+                        sched_cmds[sched_first_cmd[target]].unit - cp->unit - 1); }
+         int need = strlen(text) + (len ? 2 : 0);
+         if (len + need > CMDLENGTH - 1 || used + len + need + 1 > (int)sizeof(sched_out_text)) {
+            error("a rescheduled time unit is too long", text);
+            return false; }
+         sprintf(line + len, "%s%s", len ? "; " : "", text);
+         len += need; }
+      if (len == 0) {
+         error("a rescheduled time unit is empty", "");
+         return false; }
+      sched_out_lines[unit] = line;
+      used += len + 1; }
+   sched_out_lines[units] = NULL;
+   return true; }
+
+bool sched_check(void) { // is the new schedule equivalent to the old one?
+   struct script_t script = {"rescheduled", sched_out_lines };
+   int next_cmd[NUM_MOTORS] = {0 }; // for each motor, the old command to look for its next movement from
+   int first_op = num_script_ops, errors = interlock_errors, moves = 0;
+   bool saved_optimize = optimize_scripts;
+   optimize_scripts = false; // (so each time unit is compiled by itself)
+   bool ok = compile_script(&script) && interlock_errors == errors;
+   optimize_scripts = saved_optimize;
+   for (int op = first_op; ok && op < num_script_ops; ++op) {
+      struct script_op_t *sop = &script_ops[op];
+      if (sop->motor_num == END_OF_UNIT || sop->motor_num == SKIP_OP) continue;
+      int ndx = next_cmd[sop->motor_num];
+      while (ndx < num_sched_cmds && sched_cmds[ndx].op.motor_num != sop->motor_num) ++ndx;
+      ok = ndx < num_sched_cmds && sched_cmds[ndx].op.position == sop->position && sched_cmds[ndx].op.distance == sop->distance;
+      next_cmd[sop->motor_num] = ndx + 1;
+      ++moves; }
+   for (int ndx = 0; ndx < num_sched_cmds; ++ndx)
+      if (sched_cmds[ndx].op.motor_num != SKIP_OP) --moves; // and nothing is missing
+   num_script_ops = first_op;
+   return ok && moves == 0; }
+
+bool sched_write(const char *name, const char *what, int units) { // write the new schedule to the SD card
+   char path[sizeof(LIBRARY_DIR) + MAX_WORD + 4];
+   snprintf(path, sizeof(path), LIBRARY_DIR "%s.txt", name);
+   if (sd_card == 0) sd_card = hal_sd_begin() ? 1 : -1;
+   int file = sd_card > 0 ? hal_sd_create(path) : -1;
+   if (file < 0) {
+      error("can't write", path);
+      return false; }
+   char line[CMDLENGTH];
+   snprintf(line, sizeof(line), "// %s, rescheduled from %d into %d time units", what, num_sched_lines, units);
+   hal_sd_puts(file, line);
+   for (int unit = 0; unit < units; ++unit)
+      hal_sd_puts(file, sched_out_lines[unit]);
+   hal_sd_close(file);
+   library_flush(); // (in case an older one is cached)
+   Serial.printf("written to %s\n", path);
+   return true; }
+
+void do_reschedule(const char **pptr) { // reschedule {<script> | barrel} [<name>]
+   char word[MAX_WORD], name[MAX_WORD] = "", what[MAX_WORD + 16];
+   const char *savep = *pptr;
+   bool keep[SCHEDULE_LINES] = {false };
+   num_sched_lines = num_sched_cmds = sched_text_used = 0;
+   if (scan_word(pptr, word) && word_is(word, "barrel")) {
+      if (!sched_add_barrel()) return;
+      strcpy(what, "the barrel program"); }
+   else {
+      *pptr = savep;
+      struct script_t *sp = find_script(pptr);
+      if (!sp || !sched_add_script(sp)) return;
+      snprintf(what, sizeof(what), "script %s", sp->name); }
+   if (**pptr && **pptr != ';') {
+      savep = *pptr;
+      if (!scan_word(pptr, name) || find_keyword(name, KW_SCRIPTS)) { // (which "run" would find first)
+         error("bad name for the new script", savep);
+         return; } }
+   if (num_sched_lines == 0) {
+      error("nothing to reschedule", "");
+      return; }
+   if (!sched_compile()) {
+      error("can't reschedule", what);
+      return; }
+   sched_fences();
+   int units = sched_schedule(keep);
+   if (!sched_build(units) || !sched_check()) { // try the stretches one at a time
+      Serial.printf("** the new schedule isn't equivalent, so rescheduling one stretch at a time\n");
+      for (int line = 0; line < num_sched_lines; ++line) keep[line] = true;
+      for (int line = 0; line < num_sched_lines; ++line)
+         if (sched_fence[line] && !sched_fixed[line]) {
+            keep[line] = false;
+            got_error = false;
+            units = sched_schedule(keep);
+            if (!sched_build(units) || !sched_check()) keep[line] = true; }
+      got_error = false;
+      units = sched_schedule(keep);
+      if (!sched_build(units) || !sched_check()) {
+         error("can't reschedule", what);
+         return; } }
+   Serial.printf("%s: %d time units rescheduled into %d\n", what, num_sched_lines, units);
+   for (int unit = 0; unit < units; ++unit)
+      Serial.printf("  %s\n", sched_out_lines[unit]);
+   if (name[0]) sched_write(name, what, units); }
+
+//****  operation and variable cards
+
+// The instruction assembler (simulations/instruction_simulator/instruction.py) makes
+// programs for the whole engine as three decks of cards: a loop of operation cards, a
+// loop of variable cards that name the Store axes each operation uses, and number cards
+// for constants. "cards run" executes such a deck, either from a file on the SD card, or
+// from one that was sent a card at a time with "cards punch", which stream.py can do.
+//
+// Each card is one line:
+//    O <operation> [<skip>]       // add sub mul div shl shr jmp jmpz jmpn jmpp num stop;
+//                                 //   a jump skips that many operation cards (if negative, back)
+//    V <axis>[.R] ... [<skip>]    // like V3 or V3.R, and for a jump, how many variable cards to skip
+//    N <value>                    // a number card
+//    D <decimals>                 // the implied decimal places for mul and div
+// The cards of each kind are in the order they were punched, and needn't be grouped.
+//
+// There is no Store in the prototype, so its axes are kept here, and the result of each
+// operation is computed the way instruction.py does it. The mill's part of an operation
+// is done by running the script with the same name, from those predefined or from the SD
+// card library, if there is one; operations without a script take no time.
+//
+// Each deck is read through a window of decoded cards. While an operation's time units
+// run, the cards after it are read ahead into the window, so the mill doesn't wait for
+// the card reader, and jumps back to cards that are still in the window, like a short
+// loop, don't read the cards again.
+
+#define NUM_STORE_AXES 25
+#define MAX_CARD_AXES 4              // the most axes on one variable card
+#define CARD_WINDOW 32               // how many decoded cards we keep for each deck,
+#define CARD_READ_AHEAD 16           //   and how many of them are read ahead
+#define CARD_DECK_TEXT 4096          // the most characters of cards sent with "cards punch"
+#define CARDS_DIR "/cards/"
+
+enum card_op_t {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_SHL, OP_SHR, OP_JMP, OP_JMPZ, OP_JMPN, OP_JMPP, OP_NUM, OP_STOP, NUM_CARD_OPS };
+const char *card_ops[] = {"add", "sub", "mul", "div", "shl", "shr", "jmp", "jmpz", "jmpn", "jmpp", "num", "stop", NULL };
+#define CARD_RESTORING 0x80          // in a variable card's axis: the access doesn't zero the axis
+
+enum card_deck_t {DECK_OP, DECK_VAR, DECK_NUM, NUM_DECKS };
+const char deck_kinds[] = {'O', 'V', 'N' };
+
+struct card_t {
+   long value;                       // a number card's value, or a jump's skip
+   byte op;                          // an operation card's card_op_t
+   byte num_axes;                    // for a variable card,
+   byte axes[MAX_CARD_AXES]; };      //   the axis numbers, maybe with CARD_RESTORING
+
+struct card_reader_t {               // one deck being read
+   int file;                         // the SD card file, or -1 if the deck was punched
+   int text_pos;                     // if it was, where we are in card_text
+   long file_card;                   // the number within the deck of the next card read
+   long count;                       // how many cards the deck has, or 0 if we haven't seen the end
+   long next_read;                   // the position of the next card read, counting around the loop,
+   long first_buffered;              //   the first of those still in the window,
+   long current;                     //   and the card at the reading prism
+   struct card_t window[CARD_WINDOW]; // position p is at [p % CARD_WINDOW]
+} card_readers[NUM_DECKS];
+
+long store[NUM_STORE_AXES];
+int card_decimals = 0;
+char card_text[CARD_DECK_TEXT];      // cards sent with "cards punch", one per line
+int card_text_length = 0;
+char card_deck_name[MAX_WORD];       // the deck on the SD card, or "" for the punched deck
+bool cards_running = false;
+
+struct { // what "cards run" reports
+   unsigned long cards_read, reads_waited, jumps_in_window, jumps_reread; } card_stats;
+
+void card_open(struct card_reader_t *rp) { // start reading a deck from its first card
+   if (rp->file >= 0) hal_sd_close(rp->file);
+   rp->file = -1;
+   rp->text_pos = 0;
+   rp->file_card = 0;
+   if (card_deck_name[0]) {
+      char path[sizeof(CARDS_DIR) + MAX_WORD + 4];
+      snprintf(path, sizeof(path), CARDS_DIR "%s.txt", card_deck_name);
+      if (sd_card == 0) sd_card = hal_sd_begin() ? 1 : -1;
+      if (sd_card < 0 || (rp->file = hal_sd_open(path)) < 0) error("can't read card deck", card_deck_name); } }
+
+bool card_gets(struct card_reader_t *rp, char *line) { // the next line of the deck, or false at the end
+   if (rp->file >= 0) return library_gets(rp->file, line);
+   if (card_deck_name[0] || rp->text_pos >= card_text_length) return false;
+   int len = strcspn(card_text + rp->text_pos, "\n");
+   memcpy(line, card_text + rp->text_pos, len);
+   line[len] = 0;
+   rp->text_pos += len + 1;
+   return true; }
+
+bool scan_card(const char *line, int deck, struct card_t *cp) { // decode a card of the deck, or return false
+   const char *ptr = line;
+   char word[MAX_WORD];
+   skip_blanks(&ptr);
+   char kind = toupper(*ptr++);
+   if (kind == 'D' && deck == DECK_OP) { // (not a card, but it comes with them)
+      if (!scan_int(&ptr, &card_decimals, 0, 9)) error("bad decimals", line);
+      return false; }
+   if (!strchr("OVND", kind) && deck == DECK_OP) error("bad card", line);
+   if (kind != deck_kinds[deck] || (*ptr != ' ' && *ptr != '\t')) return false;
+   skip_blanks(&ptr);
+   memset(cp, 0, sizeof(*cp));
+   int num = 0;
+   switch (deck) {
+      case DECK_OP:
+         scan_word(&ptr, word);
+         for (cp->op = 0; card_ops[cp->op] && !word_is(word, card_ops[cp->op]); ++cp->op) ;
+         if (!card_ops[cp->op]) break;
+         if (cp->op >= OP_JMP && cp->op <= OP_JMPP && !scan_int(&ptr, &num, -9999, 9999)) break;
+         cp->value = num;
+         if (*ptr) break;
+         return true;
+      case DECK_VAR:
+         while (toupper(*ptr) == 'V' && isdigit(ptr[1]) && cp->num_axes < MAX_CARD_AXES) {
+            ++ptr;
+            if (!scan_int(&ptr, &num, 0, NUM_STORE_AXES - 1)) break;
+            if (*ptr == '.' && toupper(ptr[1]) == 'R') {
+               num |= CARD_RESTORING;
+               ptr += 2;
+               skip_blanks(&ptr); }
+            cp->axes[cp->num_axes++] = num; }
+         if (*ptr && !scan_int(&ptr, &num, -9999, 9999)) break;
+         cp->value = num;
+         if (cp->num_axes == 0 || *ptr) break;
+         return true;
+      case DECK_NUM: {
+            char *endp;
+            cp->value = strtol(ptr, &endp, 10);
+            if (endp == ptr) break;
+            ptr = endp;
+            skip_blanks(&ptr);
+            if (*ptr) break;
+            return true; } }
+   error("bad card", line);
+   return false; }
+
+bool read_card(struct card_reader_t *rp) { // read the next card of a deck into the window
+   int deck = rp - card_readers;
+   char line[CMDLENGTH];
+   struct card_t *cp = &rp->window[rp->next_read % CARD_WINDOW];
+   while (!got_error) {
+      if (!card_gets(rp, line)) { // the end of the deck, which is a loop
+         if (rp->file_card == 0) {
+            char kind[2] = {deck_kinds[deck], 0 };
+            error("the deck has no cards of kind", kind);
+            break; }
+         rp->count = rp->file_card;
+         card_open(rp);
+         continue; }
+      if (!scan_card(line, deck, cp)) continue;
+      ++rp->file_card;
+      ++card_stats.cards_read;
+      if (++rp->next_read - rp->first_buffered > CARD_WINDOW) ++rp->first_buffered;
+      return true; }
+   return false; }
+
+bool seek_card(struct card_reader_t *rp, long position) { // make the window start at a card that isn't in it
+   if (position < rp->first_buffered) { // go back and read it again
+      ++card_stats.jumps_reread;
+      long card = rp->count ? position % rp->count : position;
+      card_open(rp);
+      while (!got_error && rp->file_card < card) {
+         char line[CMDLENGTH];
+         struct card_t skipped;
+         if (!card_gets(rp, line)) error("the deck is shorter than it was", "");
+         else if (scan_card(line, rp - card_readers, &skipped)) ++rp->file_card; }
+      rp->next_read = rp->first_buffered = position; }
+   while (!got_error && rp->next_read <= position) // (forward, past the window)
+      if (!read_card(rp)) return false;
+   return !got_error; }
+
+struct card_t *next_card(int deck) { // the card at the reading prism, which then moves on; NULL if there was an error
+   struct card_reader_t *rp = &card_readers[deck];
+   if (rp->current < rp->first_buffered || rp->current >= rp->next_read) { // we have to wait for it
+      if (engine_running) ++card_stats.reads_waited;
+      if (!seek_card(rp, rp->current)) return NULL; }
+   return &rp->window[rp->current++ % CARD_WINDOW]; }
+
+bool jump_cards(int deck, long skip) { // move the reading prism; return false if there was an error
+   struct card_reader_t *rp = &card_readers[deck];
+   rp->current += skip;
+   if (rp->current < 0) { // back before the first card, so around the loop to the end
+      if (!rp->count) {
+         if (engine_running) ++card_stats.reads_waited;
+         while (!rp->count) // find out how big the loop is
+            if (!read_card(rp)) return false; }
+      rp->current += rp->count * ((-rp->current + rp->count - 1) / rp->count); }
+   if (skip < 0 && rp->current >= rp->first_buffered) ++card_stats.jumps_in_window;
+   return true; }
+
+void prefetch_cards(void) { // read ahead a card of each deck, while we wait for the movements
+   if (!cards_running || got_error) return;
+   for (struct card_reader_t *rp = card_readers; rp < card_readers + NUM_DECKS; ++rp)
+      if (rp->current < rp->first_buffered || rp->current > rp->next_read) seek_card(rp, rp->current);
+      else if (rp->next_read < rp->current + CARD_READ_AHEAD) read_card(rp); }
+
+struct card_t *card_operand(long *value) { // get the value of the axis on the next variable card
+   struct card_t *cp = next_card(DECK_VAR);
+   if (!cp) return NULL;
+   int axis = cp->axes[0] & ~CARD_RESTORING;
+   *value = store[axis];
+   if (!(cp->axes[0] & CARD_RESTORING)) store[axis] = 0;
+   if (debug >= 1) Serial.printf(" V%d=%ld", axis, *value);
+   return cp; }
+
+bool card_result(long value) { // put a result on the axes of the next variable card
+   struct card_t *cp = next_card(DECK_VAR);
+   if (!cp) return false;
+   if (debug >= 1) Serial.printf(" = %ld to", value);
+   for (int ndx = 0; ndx < cp->num_axes; ++ndx) {
+      int axis = cp->axes[ndx] & ~CARD_RESTORING;
+      if (store[axis] != 0) {
+         char name[8];
+         sprintf(name, "V%d", axis);
+         error("assignment to a non-zero axis", name);
+         return false; }
+      if (debug >= 1) Serial.printf(" V%d", axis);
+      store[axis] = value; }
+   return true; }
+
+long long power_of_ten(int exponent) {
+   long long value = 1;
+   while (exponent-- > 0) value *= 10;
+   return value; }
+
+bool card_operation(int op, long *result) { // get the operands and compute the result, as instruction.py does
+   long x, y = 0;
+   if (!card_operand(&x) || (op <= OP_DIV && !card_operand(&y))) return false;
+   switch (op) {
+      case OP_ADD: *result = x + y; break;
+      case OP_SUB: *result = x - y; break;
+      case OP_MUL: // (truncated toward zero)
+         *result = (long long)x * y / power_of_ten(card_decimals);
+         break;
+      case OP_DIV:
+         *result = y == 0 ? 0 : (long long)x * power_of_ten(card_decimals) / y;
+         break;
+      case OP_SHL: *result = x * 10; break;
+      case OP_SHR: *result = x >= 0 ? x / 10 : -((-x + 9) / 10); break; } // (rounded down)
+   return true; }
+
+struct script_t *card_script(int op) { // the mill's script for an operation, or NULL
+   struct script_t *sp = (struct script_t *) find_keyword(card_ops[op], KW_SCRIPTS);
+   return sp ? sp : library_script(card_ops[op]); }
+
+void run_cards(void) { // run the deck until a "stop" operation
+   bool has_script[NUM_CARD_OPS];
+   unsigned long operations = 0, start_msec = millis();
+   memset(&card_stats, 0, sizeof(card_stats));
+   for (int op = 0; op < NUM_CARD_OPS; ++op) // (so we don't look on the SD card for ones that aren't there)
+      has_script[op] = op < OP_JMP && card_script(op) != NULL;
+   for (int deck = 0; deck < NUM_DECKS && !got_error; ++deck) {
+      card_readers[deck].file = -1;
+      card_readers[deck].count = card_readers[deck].next_read = card_readers[deck].first_buffered = card_readers[deck].current = 0;
+      card_open(&card_readers[deck]); }
+   cards_running = true;
+   aborted = false;
+   while (!got_error && !aborted) { // for each operation card
+      struct card_reader_t *op_reader = &card_readers[DECK_OP];
+      long op_card = op_reader->current, result;
+      struct card_t *cp = next_card(DECK_OP);
+      if (!cp) break;
+      int op = cp->op;
+      long skip = cp->value;
+      ++operations;
+      if (debug >= 1) Serial.printf("%3ld: %-4s", (op_reader->count ? op_card % op_reader->count : op_card) + 1, card_ops[op]);
+      if (op == OP_STOP) {
+         if (debug >= 1) Serial.println();
+         break; }
+      if (op >= OP_JMP && op <= OP_JMPP) {
+         long value;
+         struct card_t *vp = card_operand(&value); // (which also has the variable cards' skip)
+         if (!vp) break;
+         if (op == OP_JMP || (op == OP_JMPZ && value == 0) || (op == OP_JMPN && value < 0) || (op == OP_JMPP && value > 0)) {
+            if (!jump_cards(DECK_VAR, vp->value) || !jump_cards(DECK_OP, skip)) break;
+            if (debug >= 1) Serial.printf(" jump %s\n", skip < 0 ? "back" : "forward"); }
+         else if (debug >= 1) Serial.printf(" jump not taken\n"); }
+      else {
+         if (op == OP_NUM) {
+            struct card_t *np = next_card(DECK_NUM);
+            if (!np) break;
+            result = np->value;
+            if (debug >= 1) Serial.printf(" N%ld", card_readers[DECK_NUM].current); }
+         else if (!card_operation(op, &result)) break;
+         if (!card_result(result)) break;
+         if (debug >= 1) Serial.println();
+         struct script_t *sp; // then the mill does its part
+         if (has_script[op] && (sp = card_script(op)) != NULL) run_script(sp, false); } }
+   cards_running = false;
+   for (int deck = 0; deck < NUM_DECKS; ++deck)
+      if (card_readers[deck].file >= 0) {
+         hal_sd_close(card_readers[deck].file);
+         card_readers[deck].file = -1; }
+   if (got_error || aborted || !wait_for_movements()) {
+      Serial.printf("the cards stopped after %lu operations\n", operations);
+      return; }
+   Serial.printf("%lu operations in %lu msec, %lu cards read, %lu waits for the card reader\n",
+                 operations, millis() - start_msec, card_stats.cards_read, card_stats.reads_waited);
+   Serial.printf("%lu jumps back within the window, %lu that read the cards again\n",
+                 card_stats.jumps_in_window, card_stats.jumps_reread); }
+
+void show_store(void) {
+   bool any = false;
+   for (int axis = 0; axis < NUM_STORE_AXES; ++axis)
+      if (store[axis]) {
+         Serial.printf("  V%-2d %ld\n", axis, store[axis]);
+         any = true; }
+   if (!any) Serial.println("the store is all zero"); }
+
+void do_cards(const char **pptr) { // cards {run [<deck>] | punch <card> | clear | store [<axis> <value>]}
+   char word[MAX_WORD];
+   const char *savep = *pptr;
+   scan_word(pptr, word);
+   if (cards_running) error("the cards are already running", "");
+   else if (word_is(word, "run")) {
+      card_deck_name[0] = 0;
+      scan_word(pptr, card_deck_name);
+      if (!card_deck_name[0] && card_text_length == 0) error("no cards have been punched", "");
+      else run_cards(); }
+   else if (word_is(word, "punch")) { // the rest of the line
+      int len = strlen(*pptr);
+      if (card_text_length + len + 1 >= CARD_DECK_TEXT) error("too many cards", *pptr);
+      else {
+         strcpy(card_text + card_text_length, *pptr);
+         card_text_length += len;
+         card_text[card_text_length++] = '\n';
+         *pptr += len; } }
+   else if (word_is(word, "clear")) { // forget the punched cards, and zero the store
+      card_text_length = 0;
+      card_decimals = 0;
+      memset(store, 0, sizeof(store)); }
+   else if (word_is(word, "store")) {
+      int axis, value;
+      skip_blanks(pptr);
+      if (toupper(**pptr) == 'V') {
+         ++*pptr;
+         if (!scan_int(pptr, &axis, 0, NUM_STORE_AXES - 1) || !scan_int(pptr, &value, -999999999, 999999999))
+            error("bad store axis value", savep);
+         else store[axis] = value; }
+      else show_store(); }
+   else error("bad cards command", savep); }
+
 //***** command interpreter
 
-struct script_t * find_script(const char **pptr) {
+enum command_num_t { // command codes
+   CMD_ROT, CMD_LIFT, CMD_FUNCTION, CMD_GIVEOFF, CMD_ZERO, CMD_CALIBRATE, CMD_TIMEUNIT, CMD_DEBUG,
+   CMD_RUN, CMD_STEP, CMD_ON, CMD_OFF, CMD_HOME, CMD_RESET, CMD_TEST, CMD_INDICES, CMD_STATS, CMD_BENCH, CMD_OPTIMIZE, CMD_AUTOSTART,
+   CMD_LOSTCHECK, CMD_BARREL, CMD_VALUE, CMD_SKIPIF, CMD_SKIPUNLESS, CMD_LIBRARY, CMD_CARDS, CMD_TOGETHER, CMD_SWEEP, CMD_RESCHEDULE };
+
+struct command_t {
+   const char *name;            // the command keyword
+   enum command_num_t cmd;      // what it is
+   bool compilable;             // can it be used in a compiled script?
+   struct fct_move_t *fct; }    // for functional movements, the table of movements
+command_table[] = {
+   {"rot", CMD_ROT, true },
+   {"lift", CMD_LIFT, true },
+   {"lock", CMD_FUNCTION, true, fct_lock },
+   {"unlock", CMD_FUNCTION, true, fct_unlock },
+   {"mesh", CMD_FUNCTION, true, fct_mesh },
+   {"unmesh", CMD_FUNCTION, true, fct_unmesh },
+   {"finger", CMD_FUNCTION, true, fct_finger },
+   {"nofinger", CMD_FUNCTION, true, fct_nofinger },
+   {"giveoff", CMD_GIVEOFF, true },
+   {"setcarry", CMD_FUNCTION, true, fct_setcarry },
+   {"carry", CMD_FUNCTION, true, fct_carry },
+   {"keepers", CMD_FUNCTION, true, fct_keepers },
+   {"zero", CMD_ZERO },
+   {"calibrate", CMD_CALIBRATE },
+   {"timeunit", CMD_TIMEUNIT },
+   {"debug", CMD_DEBUG },
+   {"run", CMD_RUN },
+   {"step", CMD_STEP },
+   {"on", CMD_ON },
+   {"off", CMD_OFF },
+   {"home", CMD_HOME },
+   {"reset", CMD_RESET },
+   {"test", CMD_TEST },
+   {"indices", CMD_INDICES },
+   {"stats", CMD_STATS },
+   {"bench", CMD_BENCH },
+   {"optimize", CMD_OPTIMIZE },
+   {"autostart", CMD_AUTOSTART },
+   {"lostcheck", CMD_LOSTCHECK },
+   {"barrel", CMD_BARREL },
+   {"value", CMD_VALUE },
+   {"skipif", CMD_SKIPIF, true },
+   {"skipunless", CMD_SKIPUNLESS, true },
+   {"library", CMD_LIBRARY },
+   {"cards", CMD_CARDS },
+   {"together", CMD_TOGETHER },
+   {"sweep", CMD_SWEEP },
+   {"reschedule", CMD_RESCHEDULE },
+   {NULL } };
+
+void add_fct_keywords(struct fct_move_t *table) { // add the keywords of a functional movement table
+   for (struct fct_move_t *move = table; move->keyword1; ++move)
+      add_keyword(move->keyword1, (uintptr_t)table, move); } // only the first of duplicates is kept
+
+void init_keywords(void) { // build the keyword hash table
+   for (struct command_t *cp = command_table; cp->name; ++cp) {
+      add_keyword(cp->name, KW_COMMANDS, cp);
+      if (cp->fct) add_fct_keywords(cp->fct); }
+   add_fct_keywords(fct_calibrate);
+   for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+      add_keyword(pmd->axle_name, pmd->motor_type == ROTATE ? KW_ROTATE_AXLES : KW_LIFT_AXLES, pmd);
    for (struct script_t *sp = named_scripts; sp->name; ++sp)
-      if (scan_key(pptr, sp->name)) return sp;
-   error("unknown script name", *pptr);
-   return NULL; }
+      add_keyword(sp->name, KW_SCRIPTS, sp); }
+
+void scan_timing(const char **pptr, struct motord_t *pmd) { // scan the timing options after a movement of pmd
+   int percent = 0;
+   struct motord_t *after = NULL;
+   bool timed = false;
+   while (!got_error) {
+      if (scan_key(pptr, "in")) {
+         if (!scan_int(pptr, &percent, 1, 1000) || !scan_key(pptr, "%")) error("bad duration percent", *pptr); }
+      else if (scan_key(pptr, "after")) {
+         if (scan_key(pptr, "lift")) after = scan_axlename(pptr, LIFT);
+         else if (scan_key(pptr, "rot")) after = scan_axlename(pptr, ROTATE);
+         else if (!(after = (struct motord_t *) scan_keyword(pptr, KW_ROTATE_AXLES))
+                  && !(after = (struct motord_t *) scan_keyword(pptr, KW_LIFT_AXLES))) error("bad motor name", *pptr);
+         if (after == pmd) error("can't be after itself", *pptr); }
+      else break;
+      timed = true; }
+   if (timed && !got_error) time_movement(pmd, percent, after); }
+
+struct script_t * find_script(const char **pptr) { // a predefined script, or one from the SD card
+   const char *savep = *pptr;
+   struct script_t *sp = (struct script_t *) scan_keyword(pptr, KW_SCRIPTS);
+   if (!sp) {
+      char word[MAX_WORD];
+      *pptr = savep;
+      if (scan_word(pptr, word)) sp = library_script(word);
+      if (!sp) {
+         *pptr = savep;
+         error("unknown script name", *pptr); } }
+   return sp; }
 
 void scan_commands(const char *ptr) {  // can be called recursively!
    struct script_t *sp;
+   struct command_t *cp;
    got_error = false;
    skip_blanks(&ptr);
    //if (debug >= 1) Serial.printf(":%s\n", ptr);
    while (!got_error && *ptr) { // do all the commands on one line
-      if (scan_key(&ptr, "rot ")) {
-         struct motord_t *pmd;
-         int degrees;
-         if ((pmd = scan_axlename(&ptr, ROTATE))) {
-            if (scan_int(&ptr, &degrees, -360, +360))
-               queue_movement(pmd, degrees);
-            else error ("bad degrees", ptr); } }
-      else if (scan_key(&ptr, "lift" )) {
-         struct motord_t *pmd;
-         int mils;
-         if ((pmd = scan_axlename(&ptr, LIFT))) {
-            if (scan_int(&ptr, &mils, -750, +750))
-               queue_movement(pmd, mils);
-            else error("bad mils", ptr); } }
-      else if (scan_key(&ptr, "lock")) do_function(fct_lock, &ptr);
-      else if (scan_key(&ptr, "unlock")) do_function(fct_unlock, &ptr);
-      else if (scan_key(&ptr, "mesh")) do_function(fct_mesh, &ptr);
-      else if (scan_key(&ptr, "unmesh")) do_function(fct_unmesh, &ptr);
-      else if (scan_key(&ptr, "finger")) do_function(fct_finger, &ptr);
-      else if (scan_key(&ptr, "nofinger")) do_function(fct_nofinger, &ptr);
-      else if (scan_key(&ptr, "zero")) do_zero(&ptr);
-      else if (scan_key(&ptr, "calibrate")) do_calibrate(&ptr);
-      else if (scan_key(&ptr, "giveoff")) do_giveoff(&ptr);
-      else if (scan_key(&ptr, "setcarry")) do_function(fct_setcarry, &ptr);
-      else if (scan_key(&ptr, "carry")) do_function(fct_carry, &ptr);
-      else if (scan_key(&ptr, "keepers")) do_function(fct_keepers, &ptr);
-      else if (scan_key(&ptr, "timeunit ")) {
-         int timeunit_msec;
-         if (scan_int(&ptr, &timeunit_msec, 10, 5000))
-            timeunit_usec = timeunit_msec * 1000L;
-         else error("bad time in msec", ptr); }
-      else if (scan_key(&ptr, "debug ")) {
-         if (!scan_int(&ptr, &debug, 0, 5)) error("bad debug level", ptr); }
-      else if (scan_key(&ptr, "run")) {
-         if ((sp = find_script(&ptr))) do_script(sp->commands, false); }
-      else if (scan_key(&ptr, "step")) {
-         if ((sp = find_script(&ptr))) do_script(sp->commands, true); }
-      else if (scan_key(&ptr, "on")) digitalWrite(MOTOR_ENB, LOW);
-      else if (scan_key(&ptr, "off")) digitalWrite(MOTOR_ENB, HIGH);
-      else if (scan_key(&ptr, "home")) do_script(home_commands.commands, false);
-      else if (scan_key(&ptr, "reset")) do_reset();
-      else if (scan_key(&ptr, "test")) do_test();
-      else if (scan_key(&ptr, "indices")) show_indices();
-      else error ("bad command", ptr);
+      if (!(cp = (struct command_t *) scan_keyword(&ptr, KW_COMMANDS))) {
+         error ("bad command", ptr);
+         break; }
+      if (compiling && !cp->compilable) { // only movements can be compiled
+         not_compilable();
+         break; }
+      switch (cp->cmd) {
+         case CMD_ROT: {
+               struct motord_t *pmd;
+               int degrees;
+               if ((pmd = scan_axlename(&ptr, ROTATE))) {
+                  if (scan_int(&ptr, &degrees, -360, +360)) {
+                     queue_movement(pmd, degrees);
+                     scan_timing(&ptr, pmd); }
+                  else error ("bad degrees", ptr); } }
+            break;
+         case CMD_LIFT: {
+               struct motord_t *pmd;
+               int mils;
+               if ((pmd = scan_axlename(&ptr, LIFT))) {
+                  if (scan_int(&ptr, &mils, -750, +750)) {
+                     queue_movement(pmd, mils);
+                     scan_timing(&ptr, pmd); }
+                  else error("bad mils", ptr); } }
+            break;
+         case CMD_FUNCTION: {
+               struct fct_move_t *move = do_function(cp->fct, &ptr);
+               if (move) scan_timing(&ptr, motor_num_to_descr[move->motor_num]); }
+            break;
+         case CMD_GIVEOFF: do_giveoff(&ptr); break;
+         case CMD_ZERO: do_zero(&ptr); break;
+         case CMD_CALIBRATE: do_calibrate(&ptr); break;
+         case CMD_TIMEUNIT: {
+               int timeunit_msec;
+               if (scan_int(&ptr, &timeunit_msec, 10, 5000))
+                  timeunit_usec = timeunit_msec * 1000L;
+               else error("bad time in msec", ptr); }
+            break;
+         case CMD_DEBUG:
+            if (!scan_int(&ptr, &debug, 0, 5)) error("bad debug level", ptr);
+            break;
+         case CMD_RUN:
+            if ((sp = find_script(&ptr))) run_script(sp, false);
+            break;
+         case CMD_STEP:
+            if ((sp = find_script(&ptr))) run_script(sp, true);
+            break;
+         case CMD_ON: digitalWrite(MOTOR_ENB, LOW); break;
+         case CMD_OFF:
+            digitalWrite(MOTOR_ENB, HIGH);
+            for (struct motord_t *pmd = motor_descriptors; pmd->motor_number != -1; ++pmd)
+               pmd->index_referenced = false; // (it can be moved by hand now)
+            shadow_forget();
+            break;
+         case CMD_HOME: do_home(); break;
+         case CMD_RESET: do_reset(); break;
+         case CMD_TEST: do_test(); break;
+         case CMD_INDICES: show_indices(); break;
+         case CMD_STATS: {
+               char word[MAX_WORD];
+               const char *savep = ptr;
+               if (scan_word(&ptr, word) && word_is(word, "reset")) reset_stats();
+               else {
+                  ptr = savep;
+                  show_stats(); } }
+            break;
+         case CMD_BENCH: do_bench(&ptr); break;
+         case CMD_BARREL: do_barrel(&ptr); break;
+         case CMD_VALUE: do_value(&ptr); break;
+         case CMD_SKIPIF: do_skipif(&ptr, false); break;
+         case CMD_SKIPUNLESS: do_skipif(&ptr, true); break;
+         case CMD_CARDS: do_cards(&ptr); break;
+         case CMD_TOGETHER: do_together(&ptr); break;
+         case CMD_SWEEP: do_sweep(&ptr); break;
+         case CMD_RESCHEDULE: do_reschedule(&ptr); break;
+         case CMD_LIBRARY: {
+               char word[MAX_WORD];
+               const char *savep = ptr;
+               scan_word(&ptr, word);
+               if (word_is(word, "show")) library_show();
+               else if (word_is(word, "flush")) library_flush();
+               else error("bad library option", savep); }
+            break;
+         case CMD_OPTIMIZE: {
+               char word[MAX_WORD];
+               const char *savep = ptr;
+               scan_word(&ptr, word);
+               if (word_is(word, "on") || word_is(word, "off")) {
+                  optimize_scripts = word_is(word, "on");
+                  compile_scripts(); }
+               else error("bad optimize option", savep); }
+            break;
+         case CMD_AUTOSTART: {
+               char word[MAX_WORD];
+               const char *savep = ptr;
+               scan_word(&ptr, word);
+               if (word_is(word, "on") || word_is(word, "off")) {
+                  config.autostart = word_is(word, "on") ? AUTOSTART_ON : 0;
+                  write_config(); }
+               else error("bad autostart option", savep); }
+            break;
+         case CMD_LOSTCHECK: {
+               char word[MAX_WORD];
+               const char *savep = ptr;
+               scan_word(&ptr, word);
+               if (word_is(word, "off")) {
+                  lost_check = LOSTCHECK_OFF;
+                  detachInterrupt(digitalPinToInterrupt(F_ROTATE_INDEX));
+                  detachInterrupt(digitalPinToInterrupt(A_ROTATE_INDEX)); }
+               else if (word_is(word, "correct") || word_is(word, "stop")) {
+                  lost_check = word_is(word, "stop") ? LOSTCHECK_STOP : LOSTCHECK_CORRECT;
+                  watch_index_switches(); }
+               else error("bad lostcheck option", savep); }
+            break; }
       scan_key(&ptr, ";"); } }
 
+//****  binary streaming protocol
+
+// A host program can stream commands without waiting for each line to be done by sending
+// binary frames instead of text. A frame is
+//    SOH, type, payload length (0..255), payload, checksum
+// where the checksum makes the 8-bit sum of everything from the type through the checksum
+// zero. Multibyte numbers are little-endian. Frames are checked as they arrive, which is
+// whenever we're waiting for something, and saved in a receive ring. They are then done
+// in order, each one as a time unit that is queued behind the previous one, so there are
+// no gaps between them. An SOH typed at the command prompt starts streaming, and it
+// continues until an end frame, an abort, or an error.
+//
+// Flow control is by credits: we tell the host how many more bytes it may send, starting
+// with the size of the ring, and then in batches as frames are removed from the ring.
+// Text output like warnings and traces continues during streaming, and never contains SOH.
+//
+// frames from the host:
+//    'S'  start: this must be first, and is sent before any credit is received
+//    'U'  a time unit: the duration in msec (16 bits, 0 for the current timeunit),
+//         then 4 bytes for each movement: motor number, op_kind_t, signed 16-bit value
+//    'C'  a line of text commands, done as one time unit just like console input
+//    'E'  the end: acknowledged when all the movements are finished
+//    'A'  abort: stop immediately, and ignore whatever else has been sent
+// frames to the host:
+//    'K'  a credit of more bytes (16 bits)
+//    'D'  done: the end frame was reached and all the movements are finished
+//    'N'  not done: streaming stopped early for a nak_reason_t (8 bits)
+// stream.py is a host program that sends scripts this way.
+
+#define RX_RING_SIZE 2048           // bytes of received frames, which must be a power of 2
+#define RX_CREDIT_BATCH 256         // return credits in batches at least this big
+#define STREAM_TIMEOUT_MSEC 10000   // stop streaming if the host is silent this long while we're idle
+
+enum op_kind_t { // kinds of movement in a 'U' frame
+   OP_USTEPS,        // signed microsteps
+   OP_DISTANCE,      // signed degrees or mils, like "rot" and "lift"
+   OP_POSITION };    // a position relative to neutral, like a functional movement
+
+enum nak_reason_t { // why streaming was stopped; keep stream.py in sync
+   NAK_CHECKSUM = 1, // a frame was garbled
+   NAK_OVERFLOW,     // the host sent more than its credit
+   NAK_BAD_FRAME,    // a frame of an unknown type or the wrong length
+   NAK_BAD_OP,       // a bad movement in a 'U' frame
+   NAK_COMMAND,      // an error in a 'C' frame
+   NAK_ABORTED,      // the host, or a motor fault, aborted the movements
+   NAK_TIMEOUT };    // the host went silent
+
+byte rx_ring[RX_RING_SIZE];     // frames saved as type, length, payload
+unsigned rx_head, rx_tail;      // free-running byte counts: frames are added at the head and removed at the tail
+enum {RX_SOH, RX_TYPE, RX_LENGTH, RX_PAYLOAD, RX_CHECKSUM } rx_state; // what we're waiting to receive
+byte rx_type, rx_length, rx_sum;  // the frame being received
+unsigned rx_count;              // how many of its payload bytes have been received
+bool rx_aborted;                // has an abort frame been received?
+int rx_nak;                     // if not zero, a frame was bad for this reason
+unsigned rx_credit_owed;        // bytes removed from the ring that haven't yet been credited to the host
+unsigned long rx_last_msec;     // when we last received something
+
+void rx_poll(void) { // receive whatever has arrived
+   while (!rx_nak && Serial.available()) {
+      byte chr = Serial.read();
+      rx_last_msec = millis();
+      switch (rx_state) {
+         case RX_SOH: // (ignore anything between frames)
+            if (chr == SOH) rx_state = RX_TYPE;
+            break;
+         case RX_TYPE:
+            rx_type = rx_sum = chr;
+            rx_state = RX_LENGTH;
+            break;
+         case RX_LENGTH:
+            rx_length = chr;
+            rx_sum += chr;
+            rx_count = 0;
+            if (RX_RING_SIZE - (rx_head - rx_tail) < rx_length + 2u) rx_nak = NAK_OVERFLOW;
+            rx_state = rx_length ? RX_PAYLOAD : RX_CHECKSUM;
+            break;
+         case RX_PAYLOAD: // put it in the ring, but don't add it until it's checked
+            rx_ring[(rx_head + 2 + rx_count) % RX_RING_SIZE] = chr;
+            rx_sum += chr;
+            if (++rx_count == rx_length) rx_state = RX_CHECKSUM;
+            break;
+         case RX_CHECKSUM:
+            rx_state = RX_SOH;
+            if ((byte)(rx_sum + chr) != 0) rx_nak = NAK_CHECKSUM;
+            else if (rx_type == 'A') rx_aborted = true; // do it now, not in order
+            else if (rx_type != 'S') { // add it to the ring
+               rx_ring[rx_head % RX_RING_SIZE] = rx_type;
+               rx_ring[(rx_head + 1) % RX_RING_SIZE] = rx_length;
+               rx_head += rx_length + 2; } } } }
+
+bool stream_aborted(void) { // has the host sent an abort frame?
+   rx_poll(); // (which also receives the frames that follow it)
+   return rx_aborted; }
+
+int rx_frame(byte *payload, int *plength) { // remove the next frame from the ring and return its type, or 0 if none
+   if (rx_head == rx_tail) return 0;
+   int type = rx_ring[rx_tail % RX_RING_SIZE];
+   int length = *plength = rx_ring[(rx_tail + 1) % RX_RING_SIZE];
+   for (int ndx = 0; ndx < length; ++ndx)
+      payload[ndx] = rx_ring[(rx_tail + 2 + ndx) % RX_RING_SIZE];
+   payload[length] = 0; // in case it's text
+   rx_tail += length + 2;
+   rx_credit_owed += length + 4; // what it took to send it
+   return type; }
+
+void send_frame(byte type, const byte *payload, byte length) {
+   byte sum = type + length;
+   Serial.write(SOH);
+   Serial.write(type);
+   Serial.write(length);
+   for (int ndx = 0; ndx < length; ++ndx) {
+      Serial.write(payload[ndx]);
+      sum += payload[ndx]; }
+   Serial.write((byte) - sum); }
+
+void send_credit(unsigned bytes) {
+   byte payload[2] = {(byte)bytes, (byte)(bytes >> 8) };
+   send_frame('K', payload, 2); }
+
+int stream_unit(const byte *payload, int length) { // do a 'U' frame, and return a nak_reason_t if it's bad
+   if (length < 2 || (length - 2) % 4 != 0) return NAK_BAD_FRAME;
+   unsigned long duration_usec = (payload[0] | payload[1] << 8) * 1000UL;
+   if (duration_usec == 0) duration_usec = timeunit_usec;
+   for (const byte *op = payload + 2; op < payload + length; op += 4) {
+      struct motord_t *pmd = op[0] < NUM_MOTORS ? motor_num_to_descr[op[0]] : NULL;
+      int value = (int16_t)(op[2] | op[3] << 8);
+      if (!pmd) {
+         Serial.printf("bad motor number %d\n", op[0]);
+         return NAK_BAD_OP; }
+      switch (op[1]) {
+         case OP_USTEPS:
+            if (!queue_usteps(pmd, value > 0, abs(value))) return NAK_BAD_OP;
+            shadow_forget_finger(pmd); // (we don't know what that does to the digits)
+            break;
+         case OP_DISTANCE:
+            if (!queue_distance(pmd, value)) return NAK_BAD_OP;
+            shadow_rotation(pmd, value);
+            break;
+         case OP_POSITION:
+            if (!queue_distance(pmd, value - pmd->current_position)) return NAK_BAD_OP;
+            pmd->current_position = value;
+            shadow_position(pmd, value);
+            break;
+         default:
+            Serial.printf("bad movement kind %d\n", op[1]);
+            return NAK_BAD_OP; } }
+   return submit_movements(duration_usec) ? 0 : NAK_ABORTED; }
+
+void do_stream(void) { // do binary frames from the host until the end; the first SOH has been read
+   static const char *nak_reasons[] = {"", "bad checksum", "credit overflow", "bad frame",
+                                       "bad movement", "command error", "aborted", "timeout" };
+   byte payload[256];
+   int length, nak = 0;
+   streaming = true;
+   rx_state = RX_TYPE;
+   rx_head = rx_tail = rx_credit_owed = 0;
+   rx_aborted = false;
+   rx_nak = 0;
+   rx_last_msec = millis();
+   send_credit(RX_RING_SIZE);
+   while (!nak) {
+      rx_poll();
+      drain_trace();
+      fill_timeline();
+      if (rx_aborted) {
+         stop_movements();
+         nak = NAK_ABORTED;
+         break; }
+      if (rx_nak) {
+         nak = rx_nak;
+         break; }
+      if (rx_credit_owed >= RX_CREDIT_BATCH || (rx_credit_owed && rx_head == rx_tail)) {
+         send_credit(rx_credit_owed);
+         rx_credit_owed = 0; }
+      int type = rx_frame(payload, &length);
+      if (type == 0) { // nothing to do
+         if (!engine_running && millis() - rx_last_msec > STREAM_TIMEOUT_MSEC) nak = NAK_TIMEOUT;
+         continue; }
+      switch (type) {
+         case 'U':
+            nak = stream_unit(payload, length);
+            break;
+         case 'C':
+            scan_commands((const char *)payload);
+            if (got_error) nak = NAK_COMMAND;
+            else if (!submit_movements(timeunit_usec)) nak = NAK_ABORTED;
+            break;
+         case 'E':
+            if (!wait_for_movements()) nak = NAK_ABORTED;
+            else {
+               send_frame('D', NULL, 0);
+               streaming = false;
+               return; }
+            break;
+         default: nak = NAK_BAD_FRAME; } }
+   if (rx_aborted) nak = NAK_ABORTED;
+   filling_plan->num_moves = 0; // forget anything partially queued,
+   wait_for_movements();        // but finish the time units that were
+   byte reason = nak;
+   send_frame('N', &reason, 1);
+   Serial.printf("streaming stopped: %s\n", nak_reasons[nak]);
+   while (millis() - rx_last_msec < 100) // ignore what the host sends until it notices
+      if (Serial.available()) {
+         Serial.read();
+         rx_last_msec = millis(); }
+   streaming = false; }
+
 //****  the main loop
 
 void loop(void) {
    char cmdline[CMDLENGTH];
+   journal_commit(); // remember where everything is now
    getstring(cmdline, sizeof(cmdline)); // get and parse commands
    scan_commands(cmdline);
    do_movements(timeunit_usec); // do any queued "rot" and "lift" movements
@@ -0,0 +1,125 @@
+'''file: stream.py
+
+    *******  HOST STREAMER FOR THE AE PROTOTYPE  *********
+
+This sends a program to the prototype control program using its binary streaming
+protocol, so that there is no round trip for each line and no gap between time units.
+Run it with the serial port the Teensy is on, and a file of commands:
+
+    python stream.py COM5 program.txt
+
+Each line of the file is one time unit. Lines that contain only "rot" and "lift"
+commands are resolved here into motor numbers and sent as movement frames; any other
+line is sent as text, just as if it had been typed at the console. Text from the
+prototype, like warnings, is shown as it arrives. Hit control-C to abort.
+
+Other programs, like the barrel assembler, can import this and use the Streamer class
+to send time units of movements they generated themselves.
+
+This requires pyserial. The frame formats, motor numbers, and reason codes must
+match those in prototype.ino.
+'''
+import sys, time
+
+SOH = 0x01
+OP_USTEPS, OP_DISTANCE, OP_POSITION = 0, 1, 2  # kinds of movements in a 'U' frame
+
+nak_reasons = {1: "bad checksum", 2: "credit overflow", 3: "bad frame", 4: "bad movement",
+               5: "command error", 6: "aborted", 7: "timeout" }
+
+rotate_axles = { # motor numbers, as defined symbolically in prototype.ino
+    "fr": 10, "ar": 21, "c": 13, "w": 9, "h": 8, "fk": 12, "a1k": 20, "a2k": 19 }
+lift_axles = {
+    "fl": 11, "al": 18, "fc": 23, "mp": 16, "mpc": 22, "fpc": 17, "n": 14, "h": 15 }
+
+class StreamError(Exception): pass
+
+class Streamer:
+    def __init__(self, port, echo=sys.stdout):
+        import serial
+        self.port = serial.Serial(port, 115200, timeout=0.01)
+        self.echo = echo    # where to show text from the prototype
+        self.credit = 0     # how many bytes we may still send
+        self.done = False
+        self.nak = None
+        self.state = None   # where we are in a frame being received
+        self.send('S', b"") # (the only frame sent without credit)
+
+    def frame(self, type, payload):
+        body = bytes([ord(type), len(payload)]) + bytes(payload)
+        return bytes([SOH]) + body + bytes([-sum(body) & 0xff])
+
+    def send(self, type, payload):
+        if len(payload) > 255: raise StreamError("frame too long")
+        data = self.frame(type, payload)
+        while self.credit < len(data) and type != 'S':
+            self.receive()
+        self.port.write(data)
+        if type != 'S': self.credit -= len(data)
+
+    def receive(self): # handle whatever the prototype has sent
+        for byte in self.port.read(max(1, self.port.in_waiting)):
+            if self.state is None:
+                if byte == SOH: self.state, self.body = "type", []
+                elif self.echo: self.echo.write(chr(byte))
+            else:
+                self.body.append(byte)
+                if len(self.body) >= 2 and len(self.body) == self.body[1] + 3: # type, length, payload, checksum
+                    self.state = None
+                    if sum(self.body) & 0xff: raise StreamError("garbled frame from the prototype")
+                    self.got_frame(chr(self.body[0]), self.body[2:-1])
+        if self.nak: raise StreamError("streaming stopped: " + nak_reasons.get(self.nak, str(self.nak)))
+
+    def got_frame(self, type, payload):
+        if type == 'K': self.credit += payload[0] | payload[1] << 8
+        elif type == 'D': self.done = True
+        elif type == 'N': self.nak = payload[0]
+
+    def unit(self, ops, duration_msec=0): # a time unit of (motor number, kind, value) movements
+        payload = bytearray([duration_msec & 0xff, duration_msec >> 8])
+        for motor, kind, value in ops:
+            payload += bytes([motor, kind, value & 0xff, (value >> 8) & 0xff])
+        self.send('U', payload)
+
+    def command(self, text): # a line of text commands
+        self.send('C', text.encode())
+
+    def line(self, text): # a line of commands, resolved into movements if possible
+        ops = []
+        for cmd in text.split(";"):
+            words = cmd.lower().split()
+            if not words: continue
+            axles = {"rot": rotate_axles, "lift": lift_axles}.get(words[0])
+            if len(words) != 3 or not axles or words[1] not in axles or not words[2].lstrip("+-").isdigit():
+                return self.command(text) # let the prototype interpret it
+            ops.append((axles[words[1]], OP_DISTANCE, int(words[2])))
+        if ops: self.unit(ops)
+
+    def end(self): # wait until everything has been done
+        self.send('E', b"")
+        while not self.done: self.receive()
+
+    def abort(self):
+        self.port.write(self.frame('A', b""))
+        try:
+            while not self.nak: self.receive()
+        except StreamError: pass
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        print("use: python stream.py <serial port> <program file>")
+        sys.exit(1)
+    streamer = Streamer(sys.argv[1])
+    start = time.time()
+    try:
+        with open(sys.argv[2]) as f:
+            for text in f:
+                text = text.split("//")[0].strip()
+                if text: streamer.line(text)
+        streamer.end()
+        print("\ndone in %.3f seconds" % (time.time() - start))
+    except KeyboardInterrupt:
+        streamer.abort()
+        print("\naborted")
+    except StreamError as e:
+        print("\n" + str(e))
@@ -0,0 +1,67 @@
+'''file: trace_decode.py
+
+    *******  DECODER FOR THE AE PROTOTYPE MOTION TRACE  *********
+
+With "debug 2" or higher, the prototype control program records motion events in a
+ring buffer and drains them to the console as lines like these:
+
+    #T0515006E0053EC60     an event record: event, motor, count, and time in usec, in hex
+    #D12                   12 events were dropped because the ring buffer was full
+
+Save the console session to a file, then run
+
+    python trace_decode.py console_log.txt
+
+to show the events in readable form, with times in milliseconds relative to the first
+one. Other lines in the log are ignored.
+
+The event codes and motor numbers must match those in prototype.ino.
+'''
+import sys
+
+events = { # event code: (name, meaning of the motor field, meaning of the count field)
+    1: ("queue CW", "motor", "usteps"),
+    2: ("queue CCW", "motor", "usteps"),
+    3: ("submit unit", "plan", "motors"),
+    4: ("start unit", "plan", "motors"),
+    5: ("motor done", "motor", "usteps"),
+    6: ("end unit", "plan", "usteps"),
+    7: ("engine idle", None, None),
+    8: ("abort", None, "motors"),
+    }
+
+motor_names = { # motor numbers, as defined symbolically in prototype.ino
+    11: "fl", 10: "fr", 18: "al", 21: "ar", 23: "fc", 16: "mp", 22: "mpc", 17: "fpc",
+    9: "w", 14: "n", 13: "c", 8: "h rotate", 15: "h lift", 12: "fk", 20: "a1k", 19: "a2k" }
+
+def decode(lines):
+    start = None # time of the first record
+    last = 0     # previous raw time, to handle the 32-bit wraparound of micros()
+    offset = 0
+    dropped = 0
+    for line in lines:
+        line = line.strip()
+        if line.startswith("#D"):
+            count = int(line[2:])
+            dropped += count
+            print("          *** %d events dropped" % count)
+        elif line.startswith("#T") and len(line) == 18:
+            event, motor, count, usec = (int(line[2:4], 16), int(line[4:6], 16),
+                                         int(line[6:10], 16), int(line[10:18], 16))
+            if usec < last: offset += 1 << 32
+            last = usec
+            usec += offset
+            if start is None: start = usec
+            name, motor_field, count_field = events.get(event, ("event %d" % event, "motor", "count"))
+            text = "%10.3f  %-12s" % ((usec - start) / 1000, name)
+            if motor_field == "motor": text += " %-9s" % motor_names.get(motor, str(motor))
+            elif motor_field: text += " %s %-4d" % (motor_field, motor)
+            if count_field: text += " %d %s" % (count, count_field)
+            print(text)
+    if dropped: print("total of %d events dropped" % dropped)
+
+if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        for filename in sys.argv[1:]:
+            with open(filename) as f: decode(f)
+    else: decode(sys.stdin)